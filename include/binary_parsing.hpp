@@ -17,12 +17,18 @@ concept trivially_copyable = std::is_trivially_copyable_v<T>;
 struct Reader {
   const uint8_t *begin{}, *end{};
   size_t bytes_read = 0;
+  // end of the buffer this was made from, subspans may be read up to here
+  const uint8_t *limit{};
   Reader(std::span<const uint8_t> buffer_view, size_t pos = 0)
       : begin(buffer_view.data()), end(buffer_view.end().base()),
-        bytes_read(pos) {}
+        bytes_read(pos), limit(end) {}
 
   Reader subspan(uint64_t len) {
-    return Reader(std::span(begin, len), bytes_read);
+    if (len > uint64_t(end - begin))
+      throw std::out_of_range("subspan out of range");
+    auto result = Reader(std::span(begin, len), bytes_read);
+    result.limit = limit;
+    return result;
   }
 
   template <trivially_copyable T> T consume() {
@@ -68,7 +74,7 @@ struct Reader {
   }
 
   void increment(uint64_t len) {
-    if (len + begin > end)
+    if (len > uint64_t(end - begin))
       throw std::out_of_range("incremented out of range");
     begin += len;
     bytes_read += len;
@@ -77,6 +83,91 @@ struct Reader {
   bool empty() const noexcept { return begin >= end; }
 };
 
+#ifdef FAE_HARDENED
+inline constexpr bool hardened_build = true;
+#else
+inline constexpr bool hardened_build = false;
+#endif
+
+// Reader for inner decoding loops over a validated_region. Single accesses
+// are only bounds checked in hardened builds (meson -Dhardened=true);
+// otherwise the region guarantees readable memory behind its end and the
+// loop checks overran() once when it is done. Lengths taken from the data
+// are always checked.
+struct Cursor {
+  const uint8_t *begin{}, *end{};
+
+  template <trivially_copyable T> T consume() {
+    T result;
+    std::memcpy(&result, begin, sizeof(T));
+    advance(sizeof(T));
+    return result;
+  }
+
+  uint64_t consume_uleb() {
+    uint64_t result{};
+    advance(bfs::DecodeLeb128(begin, 4, &result));
+    return result;
+  }
+
+  int64_t consume_sleb() {
+    int64_t result{};
+    advance(bfs::DecodeLeb128(begin, 4, &result));
+    return result;
+  }
+
+  void increment(uint64_t len) {
+    if (begin > end || len > uint64_t(end - begin))
+      throw std::out_of_range("incremented out of range");
+    begin += len;
+  }
+
+  bool empty() const noexcept { return begin >= end; }
+  bool overran() const noexcept { return begin > end; }
+
+private:
+  void advance(size_t len) {
+    if constexpr (hardened_build) {
+      increment(len);
+    } else {
+      begin += len;
+    }
+  }
+};
+
+// A record's bytes, checked against their buffer once. Unless has_slack() is
+// false, slack more bytes behind end may be read, so a Cursor can't leave
+// readable memory before it notices it overran.
+class validated_region {
+public:
+  // more than any single CFA instruction reads past where it starts
+  static constexpr size_t slack = 16;
+
+  explicit validated_region(Reader const &r)
+      : first(r.begin), last(r.end), limit(r.limit) {
+    if (r.begin > r.end || r.end > r.limit)
+      throw std::out_of_range("record extends past its section");
+  }
+  // Nothing is known to follow a bare span
+  explicit validated_region(std::span<const uint8_t> bytes)
+      : first(bytes.data()), last(bytes.data() + bytes.size()), limit(last) {}
+
+  bool has_slack() const noexcept { return size_t(limit - last) >= slack; }
+  std::span<const uint8_t> bytes() const noexcept { return {first, last}; }
+  Cursor cursor() const noexcept { return {first, last}; }
+  // What is left of the region where c, a cursor over it, stands
+  validated_region rest(Cursor const &c) const {
+    if (c.begin < first || c.begin > last)
+      throw std::out_of_range("cursor is outside of its region");
+    auto result = *this;
+    result.first = c.begin;
+    return result;
+  }
+
+private:
+  const uint8_t *first, *last, *limit;
+};
+
 template <std::invocable<const void *, size_t> Callback> struct Writer {
   Callback callback;
   size_t bytes_written = 0;
@@ -96,9 +187,10 @@ template <std::invocable<const void *, size_t> Callback> struct Writer {
 
 inline auto write_vector(auto &vec) {
   return Writer([&](const void *data, size_t size) {
-    auto begin = vec.end().base();
     using T = std::decay_t<decltype(*vec.data())>;
-    vec.resize((vec.size() * sizeof(T) + size) / sizeof(T));
-    std::memcpy(begin, data, size);
+    auto old_size = vec.size() * sizeof(T);
+    vec.resize((old_size + size) / sizeof(T));
+    // resize may reallocate, so only take the pointer afterwards
+    std::memcpy(reinterpret_cast<uint8_t *>(vec.data()) + old_size, data, size);
   });
 }
\ No newline at end of file
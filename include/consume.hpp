@@ -5,6 +5,15 @@
 #include <cstring>
 #include <fmt/core.h>
 #include <optional>
+#include <stdexcept>
+
+// Thrown for well-formed CFI that describes something the compact table
+// cannot express, such as a register saved in another register or a DWARF
+// expression. The FDE is skipped rather than failing the whole object.
+struct unsupported_cfi : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
 struct base_addr {
   std::optional<uint64_t> pc{}, text{}, data{}, func{};
 };
@@ -34,48 +43,139 @@ enum {
   DW_EH_PE_indirect = 0x80
 };
 
-inline int64_t consume_ptr(Reader &r, uint8_t encoding, base_addr base = {}) {
+// R is a Reader or a Cursor. Throws unsupported_cfi if the encoding is
+// relative to a base that wasn't given.
+template <typename R>
+int64_t consume_ptr(R &r, uint8_t encoding, base_addr base = {}) {
+  auto need = [&](std::optional<uint64_t> b) -> int64_t {
+    if (!b)
+      throw unsupported_cfi(fmt::format(
+          "DWARF encoding {:#0x} needs a base that isn't known here",
+          encoding));
+    return int64_t(*b);
+  };
   int64_t result = 0;
-  if (encoding & DW_EH_PE_pcrel) {
-    result = base.pc.value();
-  } else if (encoding & DW_EH_PE_textrel)
-    result = base.text.value();
-  else if (encoding & DW_EH_PE_datarel)
-    result = base.data.value();
-  else if (encoding & DW_EH_PE_funcrel)
-    result = base.func.value();
+  // the application bits are a 3-bit field, not flags: datarel is 0x30
+  switch (encoding & 0x70) {
+  case DW_EH_PE_pcrel:
+    result = need(base.pc);
+    break;
+  case DW_EH_PE_textrel:
+    result = need(base.text);
+    break;
+  case DW_EH_PE_datarel:
+    result = need(base.data);
+    break;
+  case DW_EH_PE_funcrel:
+    result = need(base.func);
+    break;
+  }
 
   switch (encoding & 0x0f) {
   case DW_EH_PE_absptr:
-    result += r.consume<uint32_t>();
+    result += r.template consume<uint32_t>();
     return result;
   case DW_EH_PE_udata2:
-    result += r.consume<uint16_t>();
+    result += r.template consume<uint16_t>();
     return result;
   case DW_EH_PE_udata4:
-    result += r.consume<uint32_t>();
+    result += r.template consume<uint32_t>();
     return result;
   case DW_EH_PE_udata8:
-    result += r.consume<uint64_t>();
+    result += r.template consume<uint64_t>();
     return result;
   case DW_EH_PE_uleb128:
     result += r.consume_uleb();
     return result;
   case DW_EH_PE_sdata2:
-    result += r.consume<int16_t>();
+    result += r.template consume<int16_t>();
     return result;
   case DW_EH_PE_sdata4:
-    result += r.consume<int32_t>();
+    result += r.template consume<int32_t>();
     return result;
   case DW_EH_PE_sdata8:
-    result += r.consume<int64_t>();
+    result += r.template consume<int64_t>();
     return result;
   case DW_EH_PE_sleb128: {
     result += r.consume_sleb();
     return result;
   }
   default:
-    throw std::runtime_error(
+    throw unsupported_cfi(
+        fmt::format("Unknown DWARF encoding: {:#0x}", encoding));
+  }
+}
+
+// Reads a pointer whose encoding was fixed when its CIE was parsed, through
+// the unchecked Cursor of a validated_region like the CFA instructions. pc is
+// the address of the field, used by DW_EH_PE_pcrel only.
+using ptr_decoder = int64_t (*)(Cursor &r, uint64_t pc);
+
+template <uint8_t Encoding> int64_t decode_ptr(Cursor &r, uint64_t pc) {
+  constexpr auto format = Encoding & 0x0f;
+  int64_t result = 0;
+  if constexpr ((Encoding & 0x70) == DW_EH_PE_pcrel)
+    result = int64_t(pc);
+  if constexpr (format == DW_EH_PE_absptr || format == DW_EH_PE_udata4)
+    result += r.consume<uint32_t>();
+  else if constexpr (format == DW_EH_PE_udata2)
+    result += r.consume<uint16_t>();
+  else if constexpr (format == DW_EH_PE_udata8)
+    result += r.consume<uint64_t>();
+  else if constexpr (format == DW_EH_PE_uleb128)
+    result += r.consume_uleb();
+  else if constexpr (format == DW_EH_PE_sdata2)
+    result += r.consume<int16_t>();
+  else if constexpr (format == DW_EH_PE_sdata4)
+    result += r.consume<int32_t>();
+  else if constexpr (format == DW_EH_PE_sdata8)
+    result += r.consume<int64_t>();
+  else if constexpr (format == DW_EH_PE_sleb128)
+    result += r.consume_sleb();
+  else
+    static_assert(format == DW_EH_PE_absptr, "unknown pointer format");
+  return result;
+}
+
+template <uint8_t Application>
+ptr_decoder select_ptr_format(uint8_t encoding) {
+  switch (encoding & 0x0f) {
+  case DW_EH_PE_absptr:
+    return decode_ptr<Application | DW_EH_PE_absptr>;
+  case DW_EH_PE_udata2:
+    return decode_ptr<Application | DW_EH_PE_udata2>;
+  case DW_EH_PE_udata4:
+    return decode_ptr<Application | DW_EH_PE_udata4>;
+  case DW_EH_PE_udata8:
+    return decode_ptr<Application | DW_EH_PE_udata8>;
+  case DW_EH_PE_uleb128:
+    return decode_ptr<Application | DW_EH_PE_uleb128>;
+  case DW_EH_PE_sdata2:
+    return decode_ptr<Application | DW_EH_PE_sdata2>;
+  case DW_EH_PE_sdata4:
+    return decode_ptr<Application | DW_EH_PE_sdata4>;
+  case DW_EH_PE_sdata8:
+    return decode_ptr<Application | DW_EH_PE_sdata8>;
+  case DW_EH_PE_sleb128:
+    return decode_ptr<Application | DW_EH_PE_sleb128>;
+  default:
+    throw unsupported_cfi(
         fmt::format("Unknown DWARF encoding: {:#0x}", encoding));
   }
 }
+
+// The decoder for encoding, picked once per CIE instead of per pointer. Only
+// absolute and PC relative pointers have a base known while parsing
+// .eh_frame, a CIE using any other is skipped with its FDEs.
+// DW_EH_PE_indirect is ignored like consume_ptr does.
+inline ptr_decoder select_ptr_decoder(uint8_t encoding) {
+  switch (encoding & 0x70) {
+  case DW_EH_PE_absptr:
+    return select_ptr_format<DW_EH_PE_absptr>(encoding);
+  case DW_EH_PE_pcrel:
+    return select_ptr_format<DW_EH_PE_pcrel>(encoding);
+  default:
+    throw unsupported_cfi(fmt::format(
+        "DWARF encoding {:#0x} has no base in .eh_frame", encoding));
+  }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdio>
+#include <fmt/core.h>
+#include <functional>
+#include <string_view>
+
+// Where the code shared by faegen and libfae reports what it skipped or
+// assumed, one message per call without a trailing newline. The library never
+// prints on its own: the tools pass print_diagnostic, libfae keeps the
+// messages for fae_last_warnings.
+using diagnostics = std::function<void(std::string_view message)>;
+
+inline void print_diagnostic(std::string_view message) {
+  fmt::println(stderr, "{}", message);
+}
@@ -3,20 +3,27 @@
 #include "elf/types.hpp"
 #include <cstdint>
 #include <fmt/core.h>
+#include <memory_resource>
 #include <span>
 #include <stdexcept>
 #include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace elf {
+// Sections and files are allocator-aware so that a whole parse can live in
+// one arena; pass the same memory_resource to parse_buffer and friends.
 struct section {
-  std::string name;
+  std::pmr::string name;
   sh::type type;
   sh::flags64 flags = {};
   u64 address = 0;
   u64 file_offset;
-  std::vector<uint8_t> data;
+  std::pmr::vector<uint8_t> data;
+  // sh::nobit sections have no bytes in the file, data stays empty and this
+  // is the size they declare
+  u64 nobits_size = 0;
   u32 link = 0;
   u32 info = 0;
   u64 alignment = 1;
@@ -50,24 +57,78 @@ struct file {
     }
     throw std::logic_error("Unknown elf_class enumeration");
   }
-  std::vector<section> sections = {null_section};
-  std::vector<program_header> program_headers;
-  std::unordered_map<std::string_view, uint32_t> name_map = {{"", 0}};
+  std::pmr::vector<section> sections = {null_section};
+  std::pmr::vector<program_header> program_headers;
+  std::pmr::unordered_map<std::string_view, uint32_t> name_map = {{"", 0}};
 
   inline section &get_section(u32 index) { return sections.at(index); }
+  inline section const &get_section(u32 index) const {
+    return sections.at(index);
+  }
   inline section &get_section(std::string_view name) {
+    return const_cast<section &>(std::as_const(*this).get_section(name));
+  }
+  inline section const &get_section(std::string_view name) const {
+    if (auto sh = find_section(name)) {
+      return *sh;
+    }
+    throw std::out_of_range(fmt::format("Section {} not found", name));
+  }
+  inline section *find_section(std::string_view name) {
+    return const_cast<section *>(std::as_const(*this).find_section(name));
+  }
+  inline section const *find_section(std::string_view name) const {
     for (auto &sh : sections) {
       if (sh.name == name) {
-        return sh;
+        return &sh;
       }
     }
-    throw std::out_of_range(fmt::format("Section {} not found", name));
+    return nullptr;
+  }
+  inline u32 index_of(section const &sh) const {
+    return &sh - sections.data();
   }
 
   bool operator==(file const &o) const noexcept = default;
 };
 
-file parse_buffer(std::span<uint8_t>);
-std::vector<uint8_t> serialize(file);
+struct symbol {
+  std::string_view name;
+  u64 value;
+  u64 size;
+  u8 info;
+  u8 other;
+  u16 section;
+  constexpr u8 binding() const noexcept { return info >> 4; }
+  constexpr u8 type() const noexcept { return info & 0xf; }
+};
+enum symbol_type : u8 { no_type, object, func, section_sym, file_sym };
+
+struct relocation {
+  u64 offset;
+  u32 symbol;
+  u32 type;
+  int64_t addend = 0; // always 0 for sh::rel, the addend is in the data
+};
+
+file parse_buffer(std::span<uint8_t>, std::pmr::memory_resource * =
+                                        std::pmr::get_default_resource());
+std::vector<uint8_t> serialize(file const &);
+
+// symtab is a sh::sym_tab or sh::dynsym section of f. Names point into f.
+std::pmr::vector<symbol> read_symbols(file const &f, section const &symtab,
+                                      std::pmr::memory_resource * =
+                                          std::pmr::get_default_resource());
+// reloc is a sh::rel or sh::rela section of f
+std::pmr::vector<relocation>
+read_relocations(file const &f, section const &reloc,
+                 std::pmr::memory_resource * =
+                     std::pmr::get_default_resource());
+// Encodes relocations as a sh::rel or sh::rela section body for f's class
+std::pmr::vector<uint8_t>
+write_relocations(file const &f, sh::type type,
+                  std::span<const relocation> relocs,
+                  std::pmr::memory_resource * =
+                      std::pmr::get_default_resource());
 
 } // namespace elf
\ No newline at end of file
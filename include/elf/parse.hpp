@@ -2,6 +2,7 @@
 
 #include "elf/types.hpp"
 #include <concepts>
+#include <type_traits>
 
 #define def_enum()
 
@@ -63,5 +64,47 @@ struct section_header {
 };
 using section_header64 = section_header<uint64_t>;
 using section_header32 = section_header<uint32_t>;
+
+// the field order differs between the two classes
+struct symbol32 {
+  u32 name_offset;
+  u32 value;
+  u32 size;
+  u8 info;
+  u8 other;
+  u16 section;
+};
+struct symbol64 {
+  u32 name_offset;
+  u8 info;
+  u8 other;
+  u16 section;
+  u64 value;
+  u64 size;
+};
+template <std::integral Int>
+using symbol = phi<symbol32, symbol64, std::is_same_v<u32, Int>>::type;
+
+template <std::integral Int> struct rel {
+  Int offset;
+  Int info;
+};
+template <std::integral Int> struct rela {
+  Int offset;
+  Int info;
+  std::make_signed_t<Int> addend;
+};
+
+// r_info packs the symbol index and the relocation type differently per class
+template <std::integral Int> constexpr u32 info_symbol(Int info) {
+  return sizeof(Int) == 4 ? info >> 8 : info >> 32;
+}
+template <std::integral Int> constexpr u32 info_type(Int info) {
+  return sizeof(Int) == 4 ? info & 0xff : info & 0xffff'ffff;
+}
+template <std::integral Int> constexpr Int make_info(u32 symbol, u32 type) {
+  return sizeof(Int) == 4 ? Int(symbol) << 8 | (type & 0xff)
+                          : Int(symbol) << 32 | type;
+}
 } // namespace parse
 } // namespace elf
\ No newline at end of file
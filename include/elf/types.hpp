@@ -73,7 +73,15 @@ inline auto format_as(file_type e) noexcept {
   }
 }
 
-enum machine_type : u16 { none_m, att, sparc, x86, avr = 0x53 };
+enum machine_type : u16 {
+  none_m,
+  att,
+  sparc,
+  x86,
+  arm = 0x28,
+  avr = 0x53,
+  msp430 = 0x69
+};
 
 inline auto format_as(machine_type e) noexcept {
   switch (e) {
@@ -85,8 +93,12 @@ inline auto format_as(machine_type e) noexcept {
     return "SPARC";
   case x86:
     return "x86";
+  case arm:
+    return "ARM";
   case avr:
     return "AVR";
+  case msp430:
+    return "MSP430";
   default:
     return "???";
   }
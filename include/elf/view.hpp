@@ -0,0 +1,134 @@
+#pragma once
+
+#include "elf/parse.hpp"
+#include "elf/types.hpp"
+#include <bit>
+#include <concepts>
+#include <cstring>
+#include <fmt/core.h>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+
+// Typed access to the on-disk ELF structures, specialized on class and byte
+// order. Callers dispatch once per file and everything below that is resolved
+// at compile time: a matching byte order decodes to a plain memcpy, a foreign
+// one to a byte swap per field.
+namespace elf::view {
+
+template <typename T>
+  requires std::integral<T> || std::is_enum_v<T>
+constexpr T byteswap(T value) noexcept {
+  if constexpr (sizeof(T) == 1) {
+    return value;
+  } else if constexpr (std::is_enum_v<T>) {
+    return T(byteswap(std::underlying_type_t<T>(value)));
+  } else {
+    using U = std::make_unsigned_t<T>;
+    auto u = U(value);
+    U result = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      result = U(result << 8 | (u & 0xff));
+      u = U(u >> 8);
+    }
+    return T(result);
+  }
+}
+
+// Calls f on every multi-byte field of an on-disk structure
+template <typename F> void fields(parse::header &h, F &&f) {
+  f(h.type), f(h.machine), f(h.e_version);
+}
+template <typename Int, typename F>
+void fields(parse::header_body<Int> &b, F &&f) {
+  f(b.entry_point), f(b.program_offset), f(b.section_offset);
+}
+template <typename F> void fields(parse::header_tail &t, F &&f) {
+  f(t.flags), f(t.header_size), f(t.ph_size), f(t.ph_num), f(t.sh_size),
+      f(t.sh_num), f(t.section_str_index);
+}
+template <typename Int, typename F>
+void fields(parse::section_header<Int> &s, F &&f) {
+  f(s.name_offset), f(s.type), f(s.flags), f(s.address), f(s.offset),
+      f(s.size), f(s.link), f(s.info), f(s.alignment), f(s.entry_size);
+}
+template <typename F> void fields(parse::symbol32 &s, F &&f) {
+  f(s.name_offset), f(s.value), f(s.size), f(s.section);
+}
+template <typename F> void fields(parse::symbol64 &s, F &&f) {
+  f(s.name_offset), f(s.section), f(s.value), f(s.size);
+}
+template <typename Int, typename F> void fields(parse::rel<Int> &r, F &&f) {
+  f(r.offset), f(r.info);
+}
+template <typename Int, typename F> void fields(parse::rela<Int> &r, F &&f) {
+  f(r.offset), f(r.info), f(r.addend);
+}
+template <typename F> void fields(program_header &p, F &&f) {
+  f(p.type), f(p.offset), f(p.virtual_addr), f(p.physical_addr),
+      f(p.file_size), f(p.mem_size), f(p.flags), f(p.alignment);
+}
+
+template <elf_class Class, endianess Endian> struct layout {
+  static constexpr elf_class format = Class;
+  static constexpr endianess endian = Endian;
+  using addr = phi<u32, u64, Class == e32>::type;
+  using body = parse::header_body<addr>;
+  using section_header = parse::section_header<addr>;
+  using symbol = parse::symbol<addr>;
+  using rel = parse::rel<addr>;
+  using rela = parse::rela<addr>;
+
+  static constexpr bool swapped =
+      (Endian == little) != (std::endian::native == std::endian::little);
+
+  // host order <-> file order; swapping is its own inverse
+  template <typename T> static constexpr T convert(T value) noexcept {
+    if constexpr (swapped) {
+      fields(value, [](auto &field) { field = byteswap(field); });
+    }
+    return value;
+  }
+
+  template <typename T> static T load(const uint8_t *p) noexcept {
+    T result;
+    std::memcpy(&result, p, sizeof(T));
+    return convert(result);
+  }
+  template <typename T> static void store(uint8_t *p, T value) noexcept {
+    value = convert(value);
+    std::memcpy(p, &value, sizeof(T));
+  }
+
+  // The i-th T of a table, bounds checked against the buffer once
+  template <typename T>
+  static T load(std::span<const uint8_t> table, size_t i) {
+    if ((i + 1) * sizeof(T) > table.size())
+      throw std::out_of_range("ELF table entry is outside of the file");
+    return load<T>(table.data() + i * sizeof(T));
+  }
+};
+
+// Calls f with the layout<> matching the file. This is the only place class
+// and byte order are looked at at runtime.
+template <typename F>
+decltype(auto) dispatch(elf_class format, endianess endian, F &&f) {
+  switch (format) {
+  case e32:
+    if (endian == little)
+      return f(layout<e32, little>{});
+    if (endian == big)
+      return f(layout<e32, big>{});
+    break;
+  case e64:
+    if (endian == little)
+      return f(layout<e64, little>{});
+    if (endian == big)
+      return f(layout<e64, big>{});
+    break;
+  }
+  throw std::runtime_error(fmt::format(
+      "unsupported ELF class {} or byte order {}", u8(format), u8(endian)));
+}
+
+} // namespace elf::view
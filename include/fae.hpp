@@ -1,8 +1,13 @@
 #pragma once
 
+#include "target.hpp"
+#include <array>
 #include <cstdint>
 #include <fmt/core.h>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 
 namespace fae {
 
@@ -15,17 +20,101 @@ struct info_entry {
   uint32_t cfa_reg;
 };
 
-struct header {
+// The first six characters of the magic name the target (see
+// fae::target), the last is '0' plus the features the table uses, so AVR
+// tables without any of them still read "avrc++0". Unwinders must refuse
+// tables with features they don't implement.
+enum feature : uint8_t {
+  extended_inst = 1 << 0,  // adjust_sp appears in the frame_inst
+  hot_entries = 1 << 1,    // a hot_index follows the header
+  trivial_ranges = 1 << 2, // a trivial_index follows, see there
+};
+constexpr inline uint8_t known_features =
+    extended_inst | hot_entries | trivial_ranges;
+
+// length is the size of the entries in bytes. It is as wide as the target's
+// addresses, so 16-bit targets keep the original layout and 32-bit ones
+// aren't limited to 64 KiB of entries.
+template <typename Length> struct basic_header {
   char header[8] = "avrc++0";
-  uint16_t length;
+  Length length;
+  constexpr uint8_t features() const noexcept {
+    return uint8_t(header[6] - '0');
+  }
+  constexpr void set_features(uint8_t f) noexcept { header[6] = char('0' + f); }
+  constexpr void set_magic(std::string_view magic) noexcept {
+    magic.copy(header, 6);
+  }
+  // matches the magic, ignoring features
+  constexpr bool valid(std::string_view magic = "avrc++") const noexcept {
+    return std::string_view(header, 6) == magic && header[7] == '\0' &&
+           header[6] >= '0' && header[6] <= '9';
+  }
 };
-struct table_entry {
-  uint16_t pc_begin;
-  uint16_t pc_end;
-  uint16_t data;
+using header = basic_header<uint16_t>;
+
+template <typename Target>
+using header_for = basic_header<typename Target::address>;
+
+// Addresses are as wide as the target's. Fields keep their order on every
+// target so that the 16-bit layout is unchanged.
+template <typename Address> struct basic_table_entry {
+  Address pc_begin;
+  Address pc_end;
+  Address data;
   uint8_t frame_reg;
   uint8_t length;
-  uint16_t lsda;
+  Address lsda;
+};
+using table_entry = basic_table_entry<uint16_t>;
+
+template <typename Target>
+using table_entry_for = basic_table_entry<typename Target::address>;
+
+/* With feature::hot_entries the first count entries are the ones most
+   likely to be unwound through, most likely first, and should be scanned
+   before anything else. The entries after them are sorted by pc_begin. */
+struct hot_index {
+  uint16_t count;
+};
+
+/* With feature::trivial_ranges functions that only need their return
+   address popped (no saved registers, the CFA right above it in SP and no
+   LSDA) have no entry. Instead count pc_ranges covering them follow the
+   entries, sorted and with adjacent ones merged, and the frame_inst come
+   after those. A PC that no entry covers but a range does is in such a
+   function. The trivial_index comes after the hot_index if there is one. */
+struct trivial_index {
+  uint16_t count;
+};
+
+template <typename Address> struct basic_pc_range {
+  Address begin;
+  Address end;
+};
+template <typename Target>
+using pc_range_for = basic_pc_range<typename Target::address>;
+
+// Where the entries start in .fae_data: after the header and what the
+// features add to it, padded to the entries' alignment
+template <typename Target>
+constexpr inline uint32_t entries_offset(uint8_t features = 0) {
+  auto size = sizeof(header_for<Target>) +
+              (features & hot_entries ? sizeof(hot_index) : 0) +
+              (features & trivial_ranges ? sizeof(trivial_index) : 0);
+  auto align = alignof(table_entry_for<Target>);
+  return (size + align - 1) / align * align;
+}
+
+/* faegen --object adds one chunk per object to the non-alloc .fae_part
+   section: this header, then the entries, then their frame_inst. pc_begin,
+   pc_end and lsda are filled in by relocations at link time, data is an
+   index into the chunk's frame_inst. Chunks are padded to 2 bytes so the
+   linker's concatenation of them can be walked. */
+struct part_header {
+  char header[8] = "faepart";
+  uint16_t entries;
+  uint16_t insts;
 };
 /* Entries are aligned by 2 so that personality_ptr
    can be read by a single movw instruction. Pad
@@ -123,29 +212,111 @@ constexpr inline uint8_t denumerate(reg r) {
   }
 };
 
-// high bit is 1
+// high bit is 1, the rest indexes the target's saved_registers
 struct pop {
   constexpr reg get_reg() const noexcept { return reg(_reg & ~0b10000000); }
+  constexpr uint8_t index() const noexcept { return _reg & ~0b10000000; }
   constexpr pop(reg b) noexcept : _reg(uint8_t(b) | 0b10000000) {}
+  constexpr explicit pop(uint8_t index) noexcept
+      : _reg(index | 0b10000000) {}
   uint8_t _reg;
 };
 
+// 0xff (a pop of no register), then a little endian uint16: moves SP by that
+// many bytes in one step. Needs feature::extended_inst.
+struct adjust_sp {
+  constexpr static uint8_t opcode = 0xff;
+  constexpr static uint32_t size = 3;
+  uint16_t bytes;
+};
+
 union frame_inst {
   pop p;
   skip s;
   uint8_t byte;
   constexpr frame_inst(skip s) : s(s) {}
   constexpr frame_inst(pop p) : p(p) {}
-  constexpr bool is_pop() const noexcept { return byte & 0b1000'0000; }
-  constexpr bool is_skip() const noexcept { return !is_pop(); }
+  // operand bytes of adjust_sp
+  constexpr explicit frame_inst(uint8_t b) : byte(b) {}
+  constexpr bool is_adjust_sp() const noexcept {
+    return byte == adjust_sp::opcode;
+  }
+  constexpr bool is_pop() const noexcept {
+    return byte & 0b1000'0000 && !is_adjust_sp();
+  }
+  constexpr bool is_skip() const noexcept { return !(byte & 0b1000'0000); }
+  // in bytes, including operands
+  constexpr uint32_t size() const noexcept {
+    return is_adjust_sp() ? adjust_sp::size : 1;
+  }
 };
 
+constexpr inline std::array<frame_inst, adjust_sp::size> encode(adjust_sp a) {
+  return {frame_inst(adjust_sp::opcode), frame_inst(uint8_t(a.bytes)),
+          frame_inst(uint8_t(a.bytes >> 8))};
+}
+
+// Calls f with each instruction of a program as a span of its bytes
+template <typename F>
+void for_each_inst(std::span<const frame_inst> program, F &&f) {
+  for (size_t i = 0; i < program.size(); i += program[i].size()) {
+    if (i + program[i].size() > program.size())
+      throw std::out_of_range("adjust_sp is missing its operand");
+    f(program.subspan(i, program[i].size()));
+  }
+}
+
 inline auto format_as(frame_inst f) {
+  if (f.is_adjust_sp())
+    return std::string("adjust sp");
   if (f.is_pop())
     return fmt::format("pop r{}", fae::denumerate(f.p.get_reg()));
   return fmt::format("skip {} bytes", (f.s.bytes));
 }
 
+// One instruction as given by for_each_inst
+template <typename Target = target::avr>
+std::string describe(std::span<const frame_inst> inst) {
+  auto i = inst.front();
+  if (i.is_adjust_sp())
+    return fmt::format("adjust sp by {} bytes",
+                       inst[1].byte | uint16_t(inst[2].byte) << 8);
+  if (i.is_pop()) {
+    if (i.p.index() >= Target::saved_registers.size())
+      throw std::out_of_range(
+          fmt::format("pop of register index {}", i.p.index()));
+    return fmt::format("pop r{}", Target::saved_registers[i.p.index()]);
+  }
+  return format_as(i);
+}
+
+inline uint8_t features_of(std::span<const frame_inst> data) {
+  uint8_t result = 0;
+  for_each_inst(data, [&](auto inst) {
+    if (inst.front().is_adjust_sp())
+      result |= extended_inst;
+  });
+  return result;
+}
+
+// Rough cycle counts for the on-target unwinder, which loads each byte with
+// lpm, branches on its kind and then does the work. Only the comparison
+// between encodings matters.
+namespace cost {
+constexpr inline uint32_t dispatch = 8;     // lpm, two tests, loop branch
+constexpr inline uint32_t move_sp = 8;      // in SPL/SPH, add, out with cli
+constexpr inline uint32_t operand_byte = 3; // lpm
+
+// SP moved by bytes as a run of skip
+constexpr inline uint32_t skips(uint32_t bytes) {
+  auto steps = (bytes + skip::max_skip_bytes - 1) / skip::max_skip_bytes;
+  return steps * (dispatch + move_sp);
+}
+constexpr inline uint32_t adjust(uint32_t) {
+  return dispatch + 2 * operand_byte + move_sp;
+}
+} // namespace cost
+
 } // namespace fae
 
 /* When unwinding, first see if cfa_reg is nonzero. If so, use out to
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "elf/elf.hpp"
+#include "fae.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <fmt/core.h>
+#include <iterator>
+#include <span>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+namespace fae {
+// Takes the .fae_data of o apart again. Returns the entries, the frame_inst,
+// the address of the frame_inst, the number of hot entries and the ranges of
+// functions without an entry of their own. Every entry's frame_inst lie
+// within the returned ones.
+template <typename Target>
+std::tuple<std::vector<table_entry_for<Target>>, std::vector<frame_inst>,
+           uint32_t, uint16_t, std::vector<pc_range_for<Target>>>
+read_fae(elf::file const &o) {
+  using entry = table_entry_for<Target>;
+  using range = pc_range_for<Target>;
+  using header = header_for<Target>;
+  std::vector<entry> table;
+  std::vector<frame_inst> data;
+  std::vector<range> trivial;
+
+  auto &scn = o.get_section(".fae_data");
+  if (scn.data.size() < sizeof(header))
+    throw std::runtime_error(".fae_data is too short for its header");
+  uint8_t const *ptr = scn.data.data();
+  auto head = reinterpret_cast<header const *>(ptr);
+  if (!head->valid(Target::magic)) {
+    throw std::runtime_error(".fae_data header does not match!");
+  }
+  if (head->features() & ~known_features) {
+    throw std::runtime_error(fmt::format(
+        ".fae_data uses unknown features {:#x}", head->features()));
+  }
+  auto offset = entries_offset<Target>(head->features());
+  if (scn.data.size() < offset + head->length)
+    throw std::runtime_error(".fae_data is shorter than its entries");
+  uint16_t hot = 0, ranges = 0;
+  auto index = reinterpret_cast<uint8_t const *>(head + 1);
+  if (head->features() & hot_entries) {
+    hot = reinterpret_cast<hot_index const *>(index)->count;
+    index += sizeof(hot_index);
+  }
+  if (head->features() & trivial_ranges)
+    ranges = reinterpret_cast<trivial_index const *>(index)->count;
+  auto ranges_size = size_t(ranges) * sizeof(range);
+  if (scn.data.size() < offset + head->length + ranges_size)
+    throw std::runtime_error(".fae_data is shorter than its ranges");
+  ptr += offset;
+  table.reserve(head->length / sizeof(entry));
+  std::ranges::copy(std::span(reinterpret_cast<const entry *>(ptr),
+                              head->length / sizeof(entry)),
+                    std::back_inserter(table));
+
+  ptr += head->length;
+  trivial.reserve(ranges);
+  std::ranges::copy(std::span(reinterpret_cast<const range *>(ptr), ranges),
+                    std::back_inserter(trivial));
+
+  ptr += ranges_size;
+  auto data_len = (scn.data.size() - head->length - offset - ranges_size) /
+                  sizeof(frame_inst);
+  data.reserve(data_len);
+  std::ranges::copy(std::span(reinterpret_cast<const frame_inst *>(ptr),
+                              reinterpret_cast<const frame_inst *>(
+                                  scn.data.end().base())),
+                    std::back_inserter(data));
+
+  uint32_t address = scn.address + head->length + offset + ranges_size;
+
+  if (hot > table.size())
+    throw std::out_of_range(".fae_data has more hot entries than entries");
+  for (size_t i = 0; i < table.size(); i++) {
+    auto &e = table[i];
+    if (e.length != 0 &&
+        (e.data < address || e.data - address + e.length > data.size()))
+      throw std::out_of_range(fmt::format(
+          "frame_inst of entry {} are outside of .fae_data", i));
+  }
+  return {std::move(table), std::move(data), address, hot, std::move(trivial)};
+}
+} // namespace fae
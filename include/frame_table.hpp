@@ -0,0 +1,139 @@
+#pragma once
+
+#include "cast.hpp"
+#include "fae.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+namespace fae {
+// What the PCs of an entry unwind with: its run of frame_inst and the
+// register the stack is found in
+struct unwind_state {
+  uint32_t data;
+  uint8_t length;
+  uint8_t frame_reg;
+  bool operator==(unwind_state const &) const = default;
+};
+
+/* The entries of a table while faegen builds it, one array per field. Rows
+   refer to their unwind_state by index, so a row is a few address-sized
+   values no matter how much the frame had to say, and each pass over the
+   table only reads the columns it needs. The plain loops over them are left
+   for the compiler to vectorize. */
+template <typename Target> class frame_table {
+public:
+  using address = typename Target::address;
+  using entry = table_entry_for<Target>;
+
+  explicit frame_table(std::pmr::memory_resource *mr)
+      : begin(mr), range(mr), lsda(mr), state(mr), states(mr) {}
+
+  size_t size() const noexcept { return begin.size(); }
+  bool empty() const noexcept { return begin.empty(); }
+  size_t capacity_bytes() const noexcept {
+    return begin.capacity() * sizeof(address) +
+           range.capacity() * sizeof(address) +
+           lsda.capacity() * sizeof(address) +
+           state.capacity() * sizeof(uint32_t) +
+           states.capacity() * sizeof(unwind_state);
+  }
+
+  void reserve(size_t n) {
+    begin.reserve(n);
+    range.reserve(n);
+    lsda.reserve(n);
+    state.reserve(n);
+  }
+
+  void push_back(address b, address r, address l, uint32_t s) {
+    begin.push_back(b);
+    range.push_back(r);
+    lsda.push_back(l);
+    state.push_back(s);
+  }
+
+  uint32_t add_state(unwind_state s) {
+    states.push_back(s);
+    return cast<uint32_t>(states.size() - 1);
+  }
+
+  address end(size_t row) const noexcept {
+    return address(begin[row] + range[row]);
+  }
+  unwind_state const &state_of(size_t row) const noexcept {
+    return states[state[row]];
+  }
+
+  // The rows from first on in order of begin, ties in row order. Sorts
+  // begin and row packed into one integer, which is one comparison and
+  // keeps the keys contiguous.
+  std::pmr::vector<uint32_t> order_by_begin(size_t first,
+                                            std::pmr::memory_resource *mr) const {
+    std::pmr::vector<uint64_t> keys(mr);
+    keys.resize(size() - std::min(first, size()));
+    for (size_t i = 0; i < keys.size(); i++)
+      keys[i] = uint64_t(begin[first + i]) << 32 | (first + i);
+    std::ranges::sort(keys);
+    std::pmr::vector<uint32_t> order(keys.size(), mr);
+    for (size_t i = 0; i < keys.size(); i++)
+      order[i] = uint32_t(keys[i]);
+    return order;
+  }
+
+  // Moves row order[i] to row i; order holds every row once
+  void permute(std::span<const uint32_t> order) {
+    auto gather = [&](auto &column) {
+      std::remove_reference_t<decltype(column)> moved(column.get_allocator());
+      moved.resize(order.size());
+      for (size_t i = 0; i < order.size(); i++)
+        moved[i] = column[order[i]];
+      column = std::move(moved);
+    };
+    gather(begin);
+    gather(range);
+    gather(lsda);
+    gather(state);
+  }
+
+  // Removes the rows dead is true for, keeping the others in order. dead is
+  // called with each row once, in order, before anything after it moves.
+  template <typename F> size_t erase_if(F &&dead) {
+    size_t kept = 0;
+    for (size_t i = 0; i < size(); i++) {
+      if (dead(i))
+        continue;
+      begin[kept] = begin[i];
+      range[kept] = range[i];
+      lsda[kept] = lsda[i];
+      state[kept] = state[i];
+      kept++;
+    }
+    auto removed = size() - kept;
+    begin.resize(kept);
+    range.resize(kept);
+    lsda.resize(kept);
+    state.resize(kept);
+    return removed;
+  }
+
+  // row as it is written to .fae_data, with offset added to its data
+  entry to_entry(size_t row, uint32_t offset) const {
+    auto &s = state_of(row);
+    return entry{.pc_begin = begin[row],
+                 .pc_end = end(row),
+                 .data = cast<address>(s.data + offset),
+                 .frame_reg = s.frame_reg,
+                 .length = s.length,
+                 .lsda = lsda[row]};
+  }
+
+  std::pmr::vector<address> begin;
+  std::pmr::vector<address> range;
+  std::pmr::vector<address> lsda;
+  std::pmr::vector<uint32_t> state;
+  std::pmr::vector<unwind_state> states;
+};
+} // namespace fae
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "diagnostics.hpp"
+#include "parse.hpp"
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// What faegen does to one file, minus the file I/O, so that faegen and
+// libfae share it
+struct generate_options {
+  // add a .fae_part to a relocatable object instead of creating .fae_data
+  bool object_mode = false;
+  // the input in error messages
+  std::string_view name = "input";
+  // contents of a PC count file ordering the table, see faegen --profile.
+  // Only used when linking.
+  std::string_view profile = {};
+  std::string_view profile_name = "profile";
+  // leave out the entries of functions no throw can unwind through, see
+  // unthrown_functions. Only used when linking.
+  bool throw_paths_only = false;
+  // receives what was skipped or assumed along the way
+  diagnostics warn = print_diagnostic;
+};
+
+// The object with .fae_data for a linked file, or the input object with a
+// .fae_part added. nullopt if there is nothing to do. CIEs are looked up in
+// and added to cies when one is passed.
+std::optional<std::vector<uint8_t>> generate_fae(std::span<uint8_t> input,
+                                                 generate_options const &,
+                                                 cie_cache *cies = nullptr);
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "perf_counters.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+
+// Phase timers for the faegen pipeline. Always compiled in; when reporting is
+// off a scope costs a single load and branch.
+namespace instrument {
+
+enum struct phase : uint8_t {
+  read_file,
+  parse_buffer,
+  parse_cie,
+  parse_fde,
+  parse_cfi,
+  dedup,
+  create_data,
+  throw_paths,
+  prune,
+  create_fae_section,
+  serialize,
+  write_file,
+};
+constexpr inline size_t phase_count = size_t(phase::write_file) + 1;
+
+constexpr inline std::string_view format_as(phase p) noexcept {
+  switch (p) {
+  case phase::read_file:
+    return "read_file";
+  case phase::parse_buffer:
+    return "elf::parse_buffer";
+  case phase::parse_cie:
+    return "parse_eh (cie)";
+  case phase::parse_fde:
+    return "parse_eh (fde)";
+  case phase::parse_cfi:
+    return "parse_cfi";
+  case phase::dedup:
+    return "dedup";
+  case phase::create_data:
+    return "create_data";
+  case phase::throw_paths:
+    return "throw_paths";
+  case phase::prune:
+    return "prune";
+  case phase::create_fae_section:
+    return "create_fae_section";
+  case phase::serialize:
+    return "elf::serialize";
+  case phase::write_file:
+    return "write_file";
+  }
+  return "???";
+}
+
+enum struct mode : uint8_t { off, table, trace };
+
+namespace detail {
+extern mode current;
+using clock = std::chrono::steady_clock;
+// counts is null unless event counters are enabled
+void record(phase, clock::time_point begin, clock::time_point end,
+            uint64_t items, perf::values const *counts) noexcept;
+
+extern bool counting;
+perf::values read_counters() noexcept;
+
+extern bool track_memory;
+// innermost phase on this thread, -1 outside of any scope
+extern thread_local int8_t current_phase;
+// called by the global operator new in alloc_hook.cpp
+void count_allocation(size_t bytes) noexcept;
+} // namespace detail
+
+inline bool enabled() noexcept { return detail::current != mode::off; }
+void enable(mode);
+
+// Adds cycles, instructions, branch and cache misses and page faults per
+// phase to the report, as far as perf::counters can open them, on each
+// thread that records a phase. Without any counter the report keeps just the
+// wall time.
+void enable_counters();
+
+// Memory accounting is enabled separately from timing. Allocations are
+// charged to the innermost scope of the allocating thread.
+inline bool memory_enabled() noexcept { return detail::track_memory; }
+void enable_memory();
+// Attributes a large buffer to name, which must outlive the report
+void note_buffer(std::string_view name, size_t bytes) noexcept;
+
+// Totals, trace events and allocations are kept per thread and only ever
+// grow. Clears those of the calling thread, so that the next report covers
+// what it does from here on.
+void reset() noexcept;
+
+// Times a phase from construction to destruction. Nested scopes are
+// inclusive, e.g. parse_fde contains the parse_cfi of its instructions.
+class scope {
+public:
+  explicit scope(phase p) noexcept
+      : p(p), active(enabled()), tracking(memory_enabled()) {
+    if (tracking) {
+      outer = detail::current_phase;
+      detail::current_phase = int8_t(p);
+    }
+    if (active) {
+      counted = detail::counting;
+      if (counted)
+        start = detail::read_counters();
+      begin = detail::clock::now();
+    }
+  }
+  scope(scope const &) = delete;
+  scope &operator=(scope const &) = delete;
+  ~scope() {
+    if (active) {
+      auto end = detail::clock::now();
+      if (counted) {
+        auto counts = detail::read_counters();
+        for (size_t i = 0; i < counts.size(); i++)
+          counts[i] -= start[i];
+        detail::record(p, begin, end, n, &counts);
+      } else {
+        detail::record(p, begin, end, n, nullptr);
+      }
+    }
+    if (tracking)
+      detail::current_phase = outer;
+  }
+
+  void items(uint64_t count) noexcept { n += count; }
+
+private:
+  phase p;
+  bool active;
+  bool tracking;
+  bool counted = false;
+  int8_t outer = -1;
+  uint64_t n = 0;
+  detail::clock::time_point begin;
+  perf::values start;
+};
+
+// Prints a table for mode::table or a Chrome trace-event JSON document for
+// mode::trace, of the calling thread. Does nothing when reporting is off.
+void report(std::FILE *);
+// Allocations per phase and the noted buffers of the calling thread, and the
+// peak RSS of the process. Does nothing unless enable_memory was called.
+void report_memory(std::FILE *);
+
+} // namespace instrument
@@ -1,15 +1,28 @@
 #pragma once
 
 #include "external/scope_guard.hpp"
+#include "instrument.hpp"
 #include <cstdio>
 #include <fmt/core.h>
 #include <span>
 #include <stdexcept>
 #include <string_view>
+#include <string>
 #include <vector>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 inline auto read_file(std::string_view path) {
+  auto timer = instrument::scope(instrument::phase::read_file);
   auto f = fopen(path.data(), "rb+");
+  if (!f)
+    throw std::runtime_error(fmt::format("could not open {}", path));
   auto guard = sg::make_scope_guard([&]() { fclose(f); });
 
   if (int err = fseek(f, 0, SEEK_END)) {
@@ -20,11 +33,54 @@ inline auto read_file(std::string_view path) {
   result.resize(ftell(f));
   fseek(f, 0, SEEK_SET);
   fread(result.data(), 1, result.size(), f);
+  timer.items(result.size());
+  instrument::note_buffer("read_file", result.size());
   return result;
 }
 
+// Writes through a uniquely named file next to output that replaces it at the
+// end, so parallel jobs and readers never see a partial file. "-" writes to
+// stdout, which may be a pipe.
 inline void write_file(std::span<uint8_t> buffer, std::string_view output = "a.out") {
-  auto f = fopen(output.data(), "wb");
+  auto timer = instrument::scope(instrument::phase::write_file);
+  timer.items(buffer.size_bytes());
+  if (output == "-") {
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    if (fwrite(buffer.data(), 1, buffer.size_bytes(), stdout) !=
+            buffer.size_bytes() ||
+        fflush(stdout) != 0)
+      throw std::runtime_error("could not write to stdout");
+    return;
+  }
+#ifdef _WIN32
+  // no atomic replace there, the file is written in place
+  auto f = fopen(std::string(output).c_str(), "wb");
+  if (!f)
+    throw std::runtime_error(fmt::format("could not open {}", output));
   auto guard = sg::make_scope_guard([&]() { fclose(f); });
   fwrite(buffer.data(), 1, buffer.size_bytes(), f);
-}
\ No newline at end of file
+#else
+  auto temp = fmt::format("{}.XXXXXX", output);
+  int fd = mkstemp(temp.data());
+  if (fd < 0)
+    throw std::runtime_error(fmt::format("could not create {}", temp));
+  auto remove_temp = sg::make_scope_guard([&]() { unlink(temp.c_str()); });
+  // mkstemp leaves it 0600, a plain fopen would have honoured the umask
+  auto mask = umask(0);
+  umask(mask);
+  fchmod(fd, 0666 & ~mask);
+  auto f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    throw std::runtime_error(fmt::format("could not open {}", temp));
+  }
+  auto written = fwrite(buffer.data(), 1, buffer.size_bytes(), f);
+  if (fclose(f) != 0 || written != buffer.size_bytes())
+    throw std::runtime_error(fmt::format("could not write {}", temp));
+  if (rename(temp.c_str(), std::string(output).c_str()) != 0)
+    throw std::runtime_error(fmt::format("could not write {}", output));
+  remove_temp.dismiss();
+#endif
+}
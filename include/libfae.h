@@ -0,0 +1,124 @@
+/* C interface of libfae: what faegen and readfae do, in process and on
+ * memory buffers. Nothing here throws or allocates memory the caller has to
+ * free; every function returns a fae_status and fae_last_error describes the
+ * last failure on the calling thread. Nothing is printed either, warnings are
+ * kept for fae_last_warnings.
+ *
+ * The ABI only grows: functions and enumerators are never removed or
+ * renumbered, and the structs below keep their layout. */
+#ifndef LIBFAE_H
+#define LIBFAE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#ifdef LIBFAE_BUILD
+#define FAE_API __declspec(dllexport)
+#else
+#define FAE_API __declspec(dllimport)
+#endif
+#else
+#define FAE_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FAE_API_VERSION 1
+
+typedef enum fae_status {
+  FAE_OK = 0,
+  /* fae_generate: no unwind info, or --object already ran on the input */
+  FAE_NOTHING_TO_DO = 1,
+  /* fae_lookup_pc: no entry covers the PC */
+  FAE_NOT_FOUND = 2,
+  /* the output doesn't fit, the needed sizes were filled in */
+  FAE_BUFFER_TOO_SMALL = 3,
+  FAE_INVALID_ARGUMENT = 4,
+  /* the input is not an ELF file this can handle */
+  FAE_BAD_INPUT = 5,
+  FAE_OUT_OF_MEMORY = 6,
+} fae_status;
+
+/* fae_options.flags */
+enum {
+  /* encode a relocatable object's FDEs into .fae_part, faegen --object */
+  FAE_OBJECT = 1 << 0,
+  /* leave out functions no exception can unwind through, faegen
+     --throw-paths-only. Only used when linking. */
+  FAE_THROW_PATHS_ONLY = 1 << 1,
+};
+
+typedef struct fae_options {
+  uint32_t flags;
+  /* contents of a PC count file ordering the table, faegen --profile.
+     Optional, only used when linking. */
+  const char *profile;
+  size_t profile_size;
+} fae_options;
+
+/* Writes the object faegen would write for the ELF file in input: the
+ * __fae_data.o for a linked file or, with FAE_OBJECT, the object with
+ * .fae_part added. options may be NULL. *out_size is set to the size of the
+ * result; if it is larger than out_capacity nothing is written and
+ * FAE_BUFFER_TOO_SMALL is returned, so a call with out_capacity 0 asks for
+ * the size. */
+FAE_API fae_status fae_generate(const uint8_t *input, size_t input_size,
+                                const fae_options *options, uint8_t *out,
+                                size_t out_capacity, size_t *out_size);
+
+typedef struct fae_entry {
+  uint64_t pc_begin, pc_end;
+  uint64_t lsda;
+  /* index of the first frame instruction in fae_table.insts */
+  uint32_t insts;
+  /* number of frame instruction bytes */
+  uint8_t length;
+  /* DWARF register the stack pointer is found in */
+  uint8_t frame_reg;
+} fae_entry;
+
+typedef struct fae_table {
+  /* set by the caller */
+  fae_entry *entries;
+  size_t entries_capacity;
+  uint8_t *insts;
+  size_t insts_capacity;
+  /* set by fae_decode_table */
+  size_t entry_count;
+  /* entries[0, hot_count) are looked up first, the rest is sorted */
+  size_t hot_count;
+  size_t inst_count;
+  uint16_t machine; /* e_machine of the table's target */
+} fae_table;
+
+/* Decodes the .fae_data section of the ELF file in input into the caller's
+ * buffers. The counts are set even if FAE_BUFFER_TOO_SMALL is returned.
+ * Entries after the hot ones are sorted by pc_begin. Functions the table only
+ * covers by a range of return-address-only frames get an entry with length 0
+ * and the stack pointer as frame_reg; neighbouring ones share one. */
+FAE_API fae_status fae_decode_table(const uint8_t *input, size_t input_size,
+                                    fae_table *table);
+
+/* Finds the entry of a decoded table covering pc, the way the unwinder
+ * does. */
+FAE_API fae_status fae_lookup_pc(const fae_table *table, uint64_t pc,
+                                 const fae_entry **entry);
+
+/* Why the last call on this thread failed, "" if it didn't. Valid until the
+ * next call on the same thread. */
+FAE_API const char *fae_last_error(void);
+
+/* What the last call on this thread skipped or assumed, such as FDEs it
+ * could not encode, one line per warning, "" if nothing. libfae never prints;
+ * these are what faegen writes to stderr. Valid until the next call on the
+ * same thread. */
+FAE_API const char *fae_last_warnings(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
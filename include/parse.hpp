@@ -1,14 +1,27 @@
 #pragma once
 
+#include "binary_parsing.hpp"
+#include "consume.hpp"
+#include "diagnostics.hpp"
+#include "elf/elf.hpp"
+#include "external/generator.hpp"
+#include "target.hpp"
+#include <array>
 #include <cstdint>
+#include <functional>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
 #include <span>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
 struct callstack {
-  std::unordered_map<uint32_t, int64_t> register_offsets;
+  std::pmr::unordered_map<uint32_t, int64_t> register_offsets;
   int32_t cfa_offset{};
-  uint32_t cfa_register;
+  uint32_t cfa_register{};
 };
 
 inline bool operator==(callstack const &lhs,
@@ -21,11 +34,142 @@ inline bool operator==(callstack const &lhs,
 struct frame {
   int64_t begin{}, range{}, lsda{};
   callstack stack;
+  // offsets of the pc_begin and LSDA pointers within .eh_frame, so unlinked
+  // objects can find the relocations that apply to them
+  uint64_t begin_field{}, lsda_field{};
 };
 
+// A complete row of the CFA table. Register rules live in a fixed array
+// indexed by DWARF register number so snapshotting a row is a flat copy.
+struct cfa_row {
+  constexpr static uint32_t max_reg = 64;
+  std::array<int32_t, max_reg> offsets;
+  uint64_t saved = 0; // bit n set if register n has an offset rule
+  int32_t cfa_offset{};
+  uint32_t cfa_register{};
+
+  void set_offset(uint32_t reg, int32_t offset) {
+    if (reg >= max_reg)
+      throw std::out_of_range("register out of range");
+    offsets[reg] = offset;
+    saved |= uint64_t(1) << reg;
+  }
+};
+
+// Values from the CIE that CFA instructions depend on
+struct cfi_params {
+  int64_t code_align = 1, data_align = -1;
+  uint8_t ptr_encoding = 0; // DW_EH_PE_absptr, for DW_CFA_set_loc
+  // bit n set if the target can restore register n, see fae::target
+  uint64_t savable = fae::target::savable_mask<fae::target::avr>();
+  uint32_t return_column = fae::target::avr::return_column;
+};
+
+// Runs the CIE's initial instructions. The result is shared by every FDE
+// of that CIE and is what DW_CFA_restore falls back to.
+cfa_row parse_initial_cfi(validated_region cie_cfi, cfi_params);
+
+// Everything allocated while parsing comes from the given memory_resource,
+// which is expected to be an arena that outlives the returned frames.
+callstack parse_cfi(cfa_row const &initial, validated_region fde_cfi,
+                    cfi_params,
+                    std::pmr::memory_resource * =
+                        std::pmr::get_default_resource());
+
 callstack parse_cfi(std::span<const uint8_t> cfi_initial,
-                      std::span<const uint8_t> fde_cfi);
+                    std::span<const uint8_t> fde_cfi,
+                    std::pmr::memory_resource * =
+                        std::pmr::get_default_resource());
+
+class cie_cache;
+
+// Decodes the FDEs of .eh_frame one at a time, as they are asked for. The
+// yielded frame is only valid until the next one is requested, move out of
+// it to keep it. The file must outlive the generator. Records that can't be
+// decoded are skipped and reported to warn.
+tl::generator<frame> each_frame(elf::file const &,
+                                std::pmr::memory_resource * =
+                                    std::pmr::get_default_resource(),
+                                std::function<bool(int64_t)> wanted = {},
+                                cie_cache *cies = nullptr,
+                                diagnostics warn = print_diagnostic);
+
+// All of each_frame at once. wanted, if given, is called with each FDE's pc_begin before its
+// instructions are decoded; FDEs it rejects are left out. CIEs are looked up
+// in and added to cies when one is passed.
+std::pmr::vector<frame> parse_object(elf::file const &,
+                                     std::pmr::memory_resource * =
+                                         std::pmr::get_default_resource(),
+                                     std::function<bool(int64_t)> wanted = {},
+                                     cie_cache *cies = nullptr,
+                                     diagnostics warn = print_diagnostic);
 
-std::vector<frame> parse_object(std::span<uint8_t>);
+struct cie {
+  uint8_t lsda_encoding = DW_EH_PE_omit, personality_encoding = DW_EH_PE_omit,
+          ptr_encoding = DW_EH_PE_absptr;
+  int64_t personality{}, code_align{}, data_align{}, ret_addr_reg{};
+  uint64_t savable{}; // of the target the CIE was decoded for
+  // chosen from the encodings in parse_cie, decode_lsda is null if omitted
+  ptr_decoder decode_begin = decode_ptr<DW_EH_PE_absptr>,
+              decode_range = decode_ptr<DW_EH_PE_absptr>,
+              decode_lsda = nullptr;
+  const uint8_t *begin_instruction{}, *end_instruction{};
+  bool has_augmentation_data = false;
+  cfa_row initial;
+};
+
+// Decoded CIEs by their encoded bytes and target. Objects from one compiler
+// share a handful of CIEs, so a cache that outlives a single file (faegen
+// --serve) decodes each of them once. Safe to share between threads. Starts
+// over once it holds more than max_cached_bytes, which a daemon fed from many
+// toolchains would otherwise grow without end.
+class cie_cache {
+public:
+  // body is the CIE after its id field, as in .eh_frame
+  cie get(std::span<const uint8_t> body, uint64_t savable);
+  size_t size() const {
+    auto lock = std::lock_guard(mutex);
+    return cies.size();
+  }
+
+  static constexpr size_t max_cached_bytes = 16 << 20;
+
+private:
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, cie> cies;
+  size_t cached_bytes = 0;
+};
+
+// Finds the FDE covering a PC without decoding all of .eh_frame. Uses the
+// binary search table from .eh_frame_hdr when the file has one and builds
+// the same table from the FDE headers otherwise. Only the matching FDE (and
+// its CIE, once) is decoded per lookup.
+class fde_index {
+public:
+  explicit fde_index(elf::file const &,
+                     std::pmr::memory_resource * =
+                         std::pmr::get_default_resource());
+
+  // nullopt if no FDE covers pc. Throws unsupported_cfi like parse_object
+  // would have skipped it.
+  std::optional<frame> lookup_fde(uint64_t pc);
+  size_t size() const noexcept { return table.size(); }
+
+private:
+  struct entry {
+    uint64_t pc;
+    uint64_t offset; // of the FDE within .eh_frame
+  };
+
+  void read_header(elf::section const &);
+  void synthesize();
+  cie const &get_cie(uint64_t offset);
+
+  elf::section const *eh_frame;
+  std::pmr::vector<entry> table;
+  std::pmr::unordered_map<uint64_t, cie> cies;
+  std::pmr::memory_resource *mr;
+  uint64_t savable;
+};
 
-std::vector<uint8_t> write_fae(std::span<frame>);
\ No newline at end of file
+std::vector<uint8_t> write_fae(std::span<frame>);
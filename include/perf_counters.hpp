@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+// Hardware and software event counters of the calling thread, opened as one
+// perf_event_open group so a read is a single syscall. Events the kernel or
+// the machine doesn't provide (no PMU in a VM, perf_event_paranoid, not
+// Linux) are left out and read as 0; wall time is always measured.
+namespace perf {
+
+enum struct event : uint8_t {
+  cycles,
+  instructions,
+  branch_misses,
+  cache_misses,
+  page_faults,
+};
+constexpr inline size_t event_count = size_t(event::page_faults) + 1;
+
+constexpr inline std::string_view format_as(event e) noexcept {
+  switch (e) {
+  case event::cycles:
+    return "cycles";
+  case event::instructions:
+    return "instructions";
+  case event::branch_misses:
+    return "branch misses";
+  case event::cache_misses:
+    return "cache misses";
+  case event::page_faults:
+    return "page faults";
+  }
+  return "???";
+}
+
+using values = std::array<uint64_t, event_count>;
+
+class counters {
+public:
+  // Starts counting right away
+  counters() noexcept;
+  counters(counters const &) = delete;
+  counters &operator=(counters const &) = delete;
+  counters(counters &&o) noexcept
+      : fds(std::exchange(o.fds, {})), order(o.order), opened(o.opened) {
+    o.opened = 0;
+  }
+  ~counters();
+
+  bool available(event e) const noexcept { return fds[size_t(e)] >= 0; }
+  // false if only wall time can be measured
+  bool any() const noexcept { return opened != 0; }
+  // Totals since construction, 0 for unavailable events
+  values read() const noexcept;
+
+private:
+  std::array<int, event_count> fds = [] {
+    std::array<int, event_count> r;
+    r.fill(-1);
+    return r;
+  }();
+  // events in the order the group reports them
+  std::array<event, event_count> order{};
+  uint8_t opened = 0;
+};
+
+struct measurement {
+  values counts{};
+  std::chrono::steady_clock::duration wall{};
+
+  uint64_t operator[](event e) const noexcept { return counts[size_t(e)]; }
+  // instructions per cycle, 0 without both counters
+  double ipc() const noexcept {
+    auto cycles = (*this)[event::cycles];
+    return cycles == 0 ? 0 : double((*this)[event::instructions]) / cycles;
+  }
+};
+
+// Runs f once and returns what it cost
+template <typename F> measurement measure(counters const &c, F &&f) {
+  auto before = c.read();
+  auto begin = std::chrono::steady_clock::now();
+  std::forward<F>(f)();
+  auto end = std::chrono::steady_clock::now();
+  auto after = c.read();
+  measurement result{.counts = {}, .wall = end - begin};
+  for (size_t i = 0; i < event_count; i++)
+    result.counts[i] = after[i] - before[i];
+  return result;
+}
+
+} // namespace perf
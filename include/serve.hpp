@@ -0,0 +1,24 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// A minimal line protocol over a Unix domain socket: a client connects,
+// sends one request line and reads one reply line back.
+namespace serve {
+
+using handler = std::function<std::string(std::string_view request)>;
+
+// Serves requests on path until the process is killed, each connection on a
+// thread of its own, so handle must be safe to call concurrently. At most one
+// job per core runs at once. A client gets 30 seconds to send its request
+// line. Replaces a stale socket file but refuses to take over a live one.
+[[noreturn]] void listen(std::string_view path, handler const &handle);
+
+// The daemon's reply to request, or nullopt if nothing is listening on path.
+std::optional<std::string> request(std::string_view path,
+                                   std::string_view request);
+
+} // namespace serve
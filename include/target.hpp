@@ -0,0 +1,118 @@
+#pragma once
+
+#include "elf/types.hpp"
+#include <array>
+#include <cstdint>
+#include <fmt/core.h>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+
+// What faegen needs to know about a core to build its compact table. Each
+// target is a set of compile-time constants; code that depends on them is a
+// template instantiated once per target behind fae::dispatch_target.
+//
+// Stack layouts are described from the unwinder's side: it walks up from SP,
+// a pop reads pop_bias bytes above SP and moves SP up by register_bytes, and
+// the walk ends return_bytes below the CFA, where the return address is.
+namespace fae::target {
+
+struct avr {
+  static constexpr elf::machine_type machine = elf::machine_type::avr;
+  static constexpr std::string_view magic = "avrc++";
+  using address = uint16_t;
+  // the index into this is what pop encodes, see fae::reg
+  static constexpr std::array<uint8_t, 18> saved_registers = {
+      2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 28, 29};
+  // Y and SP
+  static constexpr std::array<uint8_t, 2> frame_registers = {28, 32};
+  static constexpr uint8_t stack_pointer = 32;
+  static constexpr uint32_t return_column = 36;
+  static constexpr uint32_t register_bytes = 1;
+  static constexpr uint32_t return_bytes = 2;
+  // push is post-decrement, so SP points below the last byte pushed
+  static constexpr int32_t pop_bias = 1;
+  // the return address is pushed by call, not saved like a register
+  static constexpr bool return_in_register = false;
+};
+
+struct msp430 {
+  static constexpr elf::machine_type machine = elf::machine_type::msp430;
+  static constexpr std::string_view magic = "msp430";
+  using address = uint16_t;
+  static constexpr std::array<uint8_t, 7> saved_registers = {4, 5, 6, 7,
+                                                             8, 9, 10};
+  // SP and the frame pointer
+  static constexpr std::array<uint8_t, 2> frame_registers = {1, 4};
+  static constexpr uint8_t stack_pointer = 1;
+  static constexpr uint32_t return_column = 0;
+  static constexpr uint32_t register_bytes = 2;
+  static constexpr uint32_t return_bytes = 2;
+  static constexpr int32_t pop_bias = 0;
+  static constexpr bool return_in_register = false;
+};
+
+// Only for code built with .eh_frame (-fno-exceptions -funwind-tables or a
+// toolchain configured for DWARF unwinding); EHABI's .ARM.exidx is not read.
+struct cortex_m0 {
+  static constexpr elf::machine_type machine = elf::machine_type::arm;
+  static constexpr std::string_view magic = "armv6m";
+  using address = uint32_t;
+  static constexpr std::array<uint8_t, 8> saved_registers = {4, 5, 6,  7,
+                                                             8, 9, 10, 11};
+  // SP and the Thumb frame pointer
+  static constexpr std::array<uint8_t, 2> frame_registers = {13, 7};
+  static constexpr uint8_t stack_pointer = 13;
+  static constexpr uint32_t return_column = 14;
+  static constexpr uint32_t register_bytes = 4;
+  static constexpr uint32_t return_bytes = 4;
+  static constexpr int32_t pop_bias = 0;
+  // lr is pushed with the callee-saved registers, functions that never push
+  // it have no frame to unwind through and get no entry
+  static constexpr bool return_in_register = true;
+};
+
+template <typename Target> constexpr uint64_t savable_mask() {
+  uint64_t mask = 0;
+  for (auto r : Target::saved_registers)
+    mask |= uint64_t(1) << r;
+  return mask;
+}
+
+// What a pop of DWARF register reg encodes as, if it can be popped at all
+template <typename Target>
+constexpr std::optional<uint8_t> pop_index(uint32_t reg) {
+  for (uint8_t i = 0; i < Target::saved_registers.size(); i++) {
+    if (Target::saved_registers[i] == reg)
+      return i;
+  }
+  return std::nullopt;
+}
+
+template <typename Target> constexpr bool is_frame_register(uint32_t reg) {
+  for (auto r : Target::frame_registers) {
+    if (r == reg)
+      return true;
+  }
+  return false;
+}
+
+} // namespace fae::target
+
+namespace fae {
+// Calls f with the traits for machine. Throws for machines without traits,
+// whose registers and stack would otherwise be taken for some other core's.
+template <typename F> decltype(auto) dispatch_target(elf::machine_type m, F &&f) {
+  switch (m) {
+  case elf::machine_type::avr:
+    return f(target::avr{});
+  case elf::machine_type::msp430:
+    return f(target::msp430{});
+  case elf::machine_type::arm:
+    return f(target::cortex_m0{});
+  default:
+    throw std::runtime_error(
+        fmt::format("no unwind table support for machine {}", m));
+  }
+}
+} // namespace fae
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "diagnostics.hpp"
+#include "elf/elf.hpp"
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+
+// [begin, end) of a function's code
+struct code_range {
+  uint64_t begin;
+  uint64_t end;
+};
+
+// The functions of a linked AVR image that can't be on the stack while an
+// exception propagates: they neither throw nor call, directly or through
+// other functions, anything that does. Found by decoding the call, rcall,
+// jmp and rjmp instructions in each function symbol's code. Functions with an
+// indirect call or a call into code no function symbol covers are assumed to
+// throw. Sorted by begin. nullopt, after telling warn why, if the image has no
+// symbol table or no throw function in it.
+std::optional<std::pmr::vector<code_range>>
+unthrown_functions(elf::file const &, std::pmr::memory_resource *,
+                   diagnostics const &warn);
@@ -0,0 +1,95 @@
+// Global operator new/delete that feed --mem-report. Only linked into the
+// executables, libraries leave the allocator alone. Every variant is replaced
+// so that sized, aligned (which std::pmr uses) and nothrow allocations all
+// pair up with the matching free.
+#include "instrument.hpp"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+void *allocate(std::size_t size) {
+  if (instrument::memory_enabled())
+    instrument::detail::count_allocation(size);
+  return std::malloc(size ? size : 1);
+}
+
+void *allocate(std::size_t size, std::align_val_t align) {
+  if (instrument::memory_enabled())
+    instrument::detail::count_allocation(size);
+  auto a = static_cast<std::size_t>(align);
+  // aligned_alloc wants a multiple of the alignment
+  size = (size + a - 1) / a * a;
+#ifdef _WIN32
+  return _aligned_malloc(size ? size : a, a);
+#else
+  return std::aligned_alloc(a, size ? size : a);
+#endif
+}
+
+void release_aligned(void *p) noexcept {
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  std::free(p);
+#endif
+}
+} // namespace
+
+void *operator new(std::size_t size) {
+  if (auto p = allocate(size))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new[](std::size_t size) { return operator new(size); }
+void *operator new(std::size_t size, std::nothrow_t const &) noexcept {
+  return allocate(size);
+}
+void *operator new[](std::size_t size, std::nothrow_t const &) noexcept {
+  return allocate(size);
+}
+void *operator new(std::size_t size, std::align_val_t align) {
+  if (auto p = allocate(size, align))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new[](std::size_t size, std::align_val_t align) {
+  return operator new(size, align);
+}
+void *operator new(std::size_t size, std::align_val_t align,
+                   std::nothrow_t const &) noexcept {
+  return allocate(size, align);
+}
+void *operator new[](std::size_t size, std::align_val_t align,
+                     std::nothrow_t const &) noexcept {
+  return allocate(size, align);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::nothrow_t const &) noexcept { std::free(p); }
+void operator delete[](void *p, std::nothrow_t const &) noexcept {
+  std::free(p);
+}
+void operator delete(void *p, std::align_val_t) noexcept {
+  release_aligned(p);
+}
+void operator delete[](void *p, std::align_val_t) noexcept {
+  release_aligned(p);
+}
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  release_aligned(p);
+}
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+  release_aligned(p);
+}
+void operator delete(void *p, std::align_val_t,
+                     std::nothrow_t const &) noexcept {
+  release_aligned(p);
+}
+void operator delete[](void *p, std::align_val_t,
+                       std::nothrow_t const &) noexcept {
+  release_aligned(p);
+}
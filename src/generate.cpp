@@ -0,0 +1,875 @@
+#include "binary_parsing.hpp"
+#include "cast.hpp"
+#include "elf/elf.hpp"
+#include <cassert>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fmt/ranges.h>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory_resource>
+#include <optional>
+#include <ranges>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+
+#include "fae.hpp"
+#include "frame_table.hpp"
+#include "generate.hpp"
+#include "instrument.hpp"
+#include "parse.hpp"
+#include "throw_paths.hpp"
+
+template <> struct std::hash<callstack> {
+  std::size_t operator()(callstack const &stack) const noexcept {
+    size_t hash = 0;
+    for (auto &&[k, v] : stack.register_offsets) {
+      // this needs to be commutative since unordered_map is unordered
+      hash ^= k + 0x9e3779b9 + (v << 6) + (v >> 2);
+    }
+    hash = hash + 0x9e3779b9 + (stack.cfa_offset << 6) +
+           (stack.cfa_offset >> 2);
+    hash = hash + 0x9e3779b9 + (stack.cfa_register << 6) +
+           (stack.cfa_register >> 2);
+    return hash;
+  }
+};
+
+namespace {
+using namespace std::string_view_literals;
+
+uint16_t cast16(int64_t i) {
+  if (i > std::numeric_limits<uint16_t>::max()) {
+    throw std::out_of_range(fmt::format("cast16: {} is out of range", i));
+  }
+  return static_cast<uint16_t>(i);
+}
+uint8_t cast8(int64_t i) {
+  if (i > std::numeric_limits<uint8_t>::max()) {
+    throw std::out_of_range(fmt::format("cast16: {} is out of range", i));
+  }
+  return static_cast<uint8_t>(i);
+}
+// Moves SP by bytes with whichever encoding the unwinder gets through faster
+void emit_skip(std::vector<fae::frame_inst> &out, uint32_t bytes) {
+  if (bytes > fae::skip::max_skip_bytes &&
+      fae::cost::adjust(bytes) < fae::cost::skips(bytes)) {
+    auto inst = fae::encode(fae::adjust_sp{cast16(bytes)});
+    out.insert(out.end(), inst.begin(), inst.end());
+    return;
+  }
+  while (bytes > 0) {
+    uint32_t skipped = std::min(bytes, fae::skip::max_skip_bytes);
+    out.push_back({fae::skip(skipped)});
+    bytes -= skipped;
+  }
+}
+
+// Walks a callstack from SP up to the return address, popping the registers
+// the target can restore and skipping everything else.
+template <typename Target>
+void encode_stack(callstack const &unwind, std::vector<fae::frame_inst> &out,
+                  std::pmr::memory_resource *mr) {
+  // bytes between SP and where a pop of reg reads, by pop index
+  std::pmr::map<int64_t, uint8_t> offset_to_reg(mr);
+  for (auto &&[reg, offset] : unwind.register_offsets) {
+    if (auto index = fae::target::pop_index<Target>(reg))
+      offset_to_reg.insert(
+          {offset * -1 - int32_t(Target::return_bytes) + Target::pop_bias,
+           *index}); // stack grows downwards
+  }
+
+  int32_t stack = unwind.cfa_offset * -1 - int32_t(Target::return_bytes);
+  while (stack != 0 && !offset_to_reg.empty()) {
+    auto [back_off, back_reg] = *offset_to_reg.rbegin();
+    if (stack == back_off) {
+      out.push_back({fae::pop(back_reg)});
+      offset_to_reg.erase(back_off);
+      stack -= Target::register_bytes;
+    } else {
+      emit_skip(out, stack - back_off);
+      stack = back_off;
+    }
+  }
+  if (stack != 0) {
+    emit_skip(out, stack);
+  }
+}
+
+// Targets that keep the return address in a register can only be unwound
+// through frames that pushed it right below the CFA
+template <typename Target>
+bool encodable(frame const &f, diagnostics const &warn) {
+  if constexpr (Target::return_in_register) {
+    auto &offsets = f.stack.register_offsets;
+    auto it = offsets.find(Target::return_column);
+    if (it == offsets.end() || it->second != -int64_t(Target::return_bytes)) {
+      warn(fmt::format("Skipping FDE for {:#x}: return address not pushed",
+                       f.begin));
+      return false;
+    }
+  }
+  return true;
+}
+
+// Turns frames into rows of a frame_table as they are parsed. Each distinct
+// callstack is encoded into unwind_data the first time it is seen and becomes
+// one of the table's states, so memory goes with the number of distinct
+// programs rather than the number of FDEs. Programs are laid out in order of
+// first use, which depends on nothing but the input.
+template <typename Target> class table_builder {
+public:
+  explicit table_builder(std::pmr::memory_resource *mr)
+      : table(mr), programs(mr), mr(mr) {}
+
+  // Returns the row added to table, whose state's data is an index into
+  // unwind_data. Takes the callstack out of f.
+  size_t add(frame &f) {
+    using address = typename Target::address;
+    auto timer = instrument::scope(instrument::phase::dedup);
+    timer.items(1);
+    if (!fae::target::is_frame_register<Target>(f.stack.cfa_register)) {
+      throw std::runtime_error(fmt::format(
+          "CFA register r{} is not a frame register", f.stack.cfa_register));
+    }
+    auto cfa_register = f.stack.cfa_register;
+    auto [it, inserted] = programs.try_emplace(std::move(f.stack));
+    if (inserted) {
+      auto timer = instrument::scope(instrument::phase::create_data);
+      auto data = cast16(unwind_data.size());
+      encode_stack<Target>(it->first, unwind_data, mr);
+      auto size = cast8(unwind_data.size() - data);
+      it->second = table.add_state(
+          {.data = data, .length = size, .frame_reg = cast8(cfa_register)});
+      timer.items(size);
+    }
+    auto begin = cast<address>(f.begin);
+    auto end = cast<address>(f.begin + f.range);
+    table.push_back(begin, address(end - begin), cast<address>(f.lsda),
+                    it->second);
+    return table.size() - 1;
+  }
+
+  size_t distinct() const noexcept { return programs.size(); }
+
+  fae::frame_table<Target> table;
+  std::vector<fae::frame_inst> unwind_data;
+
+private:
+  std::pmr::unordered_map<callstack, uint32_t> programs;
+  std::pmr::memory_resource *mr;
+};
+
+constexpr auto shtab = "\0.shstrtab\0.fae_data\0\0"sv;
+template <typename Target> elf::file create_obj(elf::u32 flags) {
+  elf::file r{.format = elf::e32,
+              .endian = elf::little,
+              .abi = elf::os_abi::sys_v,
+              .abi_version = 0,
+              .type = elf::rel,
+              .machine = Target::machine,
+              .entry_point = 0,
+              .flags = flags,
+              .sh_str_index = 1,
+              .program_headers = {},
+              .name_map = {{"", 0},
+                           {".shstrtab", 1},
+                           {".fae_data", shtab.find(".fae_data")}}};
+  r.sections.reserve(3);
+  r.sections.push_back(elf::section{.name = ".shstrtab",
+                                    .type = elf::sh::str_tab,
+                                    .flags = elf::sh::strings,
+                                    .file_offset = r.header_size(),
+                                    .data = {shtab.begin(), shtab.end()}});
+  return r;
+}
+
+// An entry encoded by faegen --object and relocated by the linker. data is
+// already an index into the merged frame_inst.
+template <typename Target> struct prebuilt {
+  fae::table_entry_for<Target> entry;
+  std::span<const fae::frame_inst> program;
+};
+
+// the states' data is relative to the start of unwind_data, offset is where
+// that ends up
+template <typename Target>
+elf::section create_fae_section(uint32_t addr, uint32_t offset,
+                                fae::frame_table<Target> const &table,
+                                uint16_t hot,
+                                std::pmr::vector<fae::pc_range_for<Target>>
+                                    const &trivial,
+                                uint8_t features, auto &unwind_data,
+                                uint32_t file_offset,
+                                std::pmr::memory_resource *mr) {
+  using entry = fae::table_entry_for<Target>;
+  auto timer = instrument::scope(instrument::phase::create_fae_section);
+  std::pmr::vector<uint8_t> data(mr);
+  data.reserve(fae::entries_offset<Target>(features) +
+               table.size() * sizeof(entry) +
+               trivial.size() * sizeof(trivial[0]) +
+               unwind_data.size() * sizeof(unwind_data.front()));
+  auto writer = write_vector(data);
+  auto header = fae::header_for<Target>{
+      .length = cast<typename Target::address>(table.size() * sizeof(entry))};
+  header.set_magic(Target::magic);
+  header.set_features(features);
+  writer.write(header);
+  if (features & fae::hot_entries)
+    writer.write(fae::hot_index{.count = hot});
+  if (features & fae::trivial_ranges)
+    writer.write(fae::trivial_index{.count = cast16(trivial.size())});
+  data.resize(fae::entries_offset<Target>(features));
+  for (size_t i = 0; i < table.size(); i++)
+    writer.write(table.to_entry(i, offset));
+  writer.write(trivial);
+  writer.write(unwind_data);
+  timer.items(table.size());
+  return {.name = ".fae_data",
+          .type = elf::sh::prog_bit,
+          .flags = elf::sh::alloc,
+          .address = addr,
+          .file_offset = file_offset,
+          .data = std::move(data),
+          .alignment = alignof(entry)};
+}
+
+// Appends the programs of prebuilt entries to unwind_data, sharing runs
+// that are byte-identical, and adds the entries to table with states pointing
+// at the merged copy.
+template <typename Target>
+void intern_parts(std::span<prebuilt<Target>> parts,
+                  std::vector<fae::frame_inst> &unwind_data,
+                  fae::frame_table<Target> &table,
+                  std::pmr::memory_resource *mr) {
+  auto timer = instrument::scope(instrument::phase::dedup);
+  auto bytes = [](std::span<const fae::frame_inst> program) {
+    return std::string_view(reinterpret_cast<const char *>(program.data()),
+                            program.size_bytes());
+  };
+  using address = typename Target::address;
+  std::pmr::unordered_map<std::string_view, address> interned(mr);
+  // program and frame_reg -> state
+  std::pmr::unordered_map<uint64_t, uint32_t> states(mr);
+  table.reserve(table.size() + parts.size());
+  for (auto &p : parts) {
+    auto [it, inserted] = interned.insert(
+        {bytes(p.program), cast<address>(unwind_data.size())});
+    if (inserted) {
+      unwind_data.insert(unwind_data.end(), p.program.begin(),
+                         p.program.end());
+    }
+    auto key = uint64_t(it->second) << 16 | uint64_t(p.entry.length) << 8 |
+               p.entry.frame_reg;
+    auto [state, added] = states.insert({key, 0});
+    if (added) {
+      state->second = table.add_state({.data = it->second,
+                                       .length = p.entry.length,
+                                       .frame_reg = p.entry.frame_reg});
+    }
+    table.push_back(p.entry.pc_begin,
+                    address(p.entry.pc_end - p.entry.pc_begin), p.entry.lsda,
+                    state->second);
+  }
+  timer.items(interned.size());
+}
+
+// PCs and how often they were unwound through, sorted by PC
+using profile = std::pmr::vector<std::pair<uint64_t, uint64_t>>;
+
+// Parses a profile of one PC per line, 0x-prefixed hex or decimal, optionally
+// followed by a count (1 otherwise). Anything after a '#' is ignored. path is
+// only used in errors.
+profile parse_profile(std::string_view rest, std::string_view path,
+                      std::pmr::memory_resource *mr) {
+  auto number = [&](std::string_view &line, size_t n) -> std::optional<uint64_t> {
+    line.remove_prefix(std::min(line.find_first_not_of(" \t\r"), line.size()));
+    if (line.empty())
+      return std::nullopt;
+    int base = 10;
+    if (line.starts_with("0x") || line.starts_with("0X")) {
+      line.remove_prefix(2);
+      base = 16;
+    }
+    uint64_t value{};
+    auto [end, ec] =
+        std::from_chars(line.data(), line.data() + line.size(), value, base);
+    if (ec != std::errc{})
+      throw std::runtime_error(
+          fmt::format("{}:{}: expected a number", path, n));
+    line.remove_prefix(end - line.data());
+    return value;
+  };
+  profile result(mr);
+  for (size_t n = 1; !rest.empty(); n++) {
+    auto line = rest.substr(0, rest.find('\n'));
+    rest.remove_prefix(std::min(rest.size(), line.size() + 1));
+    line = line.substr(0, line.find('#'));
+    auto pc = number(line, n);
+    if (!pc)
+      continue;
+    auto count = number(line, n).value_or(1);
+    if (number(line, n))
+      throw std::runtime_error(
+          fmt::format("{}:{}: expected a PC and a count", path, n));
+    result.push_back({*pc, count});
+  }
+  std::ranges::sort(result);
+  return result;
+}
+
+// Puts the rows covering the hottest PCs first, hottest first, and sorts the
+// rest by begin. Returns how many are hot. Lookups for the hot entries are a
+// short linear scan on the target, so only a few are moved.
+template <typename Target>
+uint16_t order_by_profile(fae::frame_table<Target> &table,
+                          profile const &counts,
+                          std::pmr::memory_resource *mr) {
+  constexpr size_t max_hot = 16;
+  std::pmr::vector<uint64_t> sums(mr);
+  sums.reserve(counts.size() + 1);
+  sums.push_back(0);
+  for (auto [pc, count] : counts)
+    sums.push_back(sums.back() + count);
+  auto heat = [&](size_t i) {
+    auto first = std::ranges::lower_bound(counts, uint64_t(table.begin[i]), {},
+                                          &profile::value_type::first);
+    auto last = std::ranges::lower_bound(counts, uint64_t(table.end(i)), {},
+                                         &profile::value_type::first);
+    return sums[last - counts.begin()] - sums[first - counts.begin()];
+  };
+
+  std::pmr::vector<std::pair<uint64_t, uint32_t>> hot(mr);
+  for (size_t i = 0; i < table.size(); i++) {
+    if (auto h = heat(i))
+      hot.push_back({h, uint32_t(i)});
+  }
+  // hottest first, ties by address
+  std::ranges::sort(hot, [&](auto const &a, auto const &b) {
+    if (a.first != b.first)
+      return a.first > b.first;
+    return table.begin[a.second] < table.begin[b.second];
+  });
+  hot.resize(std::min(hot.size(), max_hot));
+
+  std::pmr::vector<uint32_t> order(mr);
+  order.reserve(table.size());
+  std::pmr::vector<bool> taken(table.size(), false, mr);
+  for (auto [h, i] : hot) {
+    order.push_back(i);
+    taken[i] = true;
+  }
+  for (auto i : table.order_by_begin(0, mr)) {
+    if (!taken[i])
+      order.push_back(i);
+  }
+  table.permute(order);
+  return uint16_t(hot.size());
+}
+
+// Rewrites unwind_data so programs come in the order rows first use them,
+// which puts the hot entries' programs at the front
+template <typename Target>
+void order_programs(fae::frame_table<Target> &table,
+                    std::vector<fae::frame_inst> &unwind_data,
+                    std::pmr::memory_resource *mr) {
+  std::vector<fae::frame_inst> ordered;
+  ordered.reserve(unwind_data.size());
+  std::pmr::unordered_map<uint64_t, uint32_t> moved(mr);
+  std::pmr::vector<bool> done(table.states.size(), false, mr);
+  for (auto id : table.state) {
+    if (done[id])
+      continue;
+    done[id] = true;
+    auto &s = table.states[id];
+    auto key = uint64_t(s.data) << 8 | s.length;
+    auto [it, inserted] = moved.insert({key, cast<uint32_t>(ordered.size())});
+    if (inserted) {
+      auto program = std::span(unwind_data).subspan(s.data, s.length);
+      ordered.insert(ordered.end(), program.begin(), program.end());
+    }
+    s.data = it->second;
+  }
+  unwind_data = std::move(ordered);
+}
+
+// With --gc-sections the FDEs of discarded functions can stay in .eh_frame,
+// their PCs resolved to 0 or to nowhere. This drops rows that aren't inside
+// an executable section or, if there is a symbol table, don't start at a
+// symbol in one. Of rows claiming the same PCs, the one matching a function
+// symbol exactly wins, else the first. Neighbours left with the same state
+// and no LSDA are merged; an LSDA's call sites are relative to pc_begin.
+// Returns how many rows were removed, which the prune phase counts.
+template <typename Target>
+size_t prune_entries(elf::file const &e, fae::frame_table<Target> &table,
+                     std::pmr::memory_resource *mr) {
+  auto timer = instrument::scope(instrument::phase::prune);
+  auto executable = [&](elf::section const &sh) {
+    return (sh.flags & elf::sh::alloc) && (sh.flags & elf::sh::execinstr);
+  };
+  std::pmr::vector<std::pair<uint64_t, uint64_t>> text(mr);
+  for (auto &sh : e.sections) {
+    if (executable(sh) && !sh.data.empty())
+      text.push_back({sh.address, sh.address + sh.data.size()});
+  }
+  std::ranges::sort(text);
+
+  // start -> size, 0 unless it is a function symbol
+  std::pmr::vector<std::pair<uint64_t, uint64_t>> starts(mr);
+  bool have_symbols = false;
+  for (auto &sh : e.sections) {
+    if (sh.type != elf::sh::sym_tab)
+      continue;
+    have_symbols = true;
+    for (auto &s : elf::read_symbols(e, sh, mr)) {
+      if (s.section == 0 || s.section >= e.sections.size() ||
+          !executable(e.get_section(s.section)))
+        continue;
+      if (s.type() == elf::func)
+        starts.push_back({s.value, s.size});
+      else if (s.type() == elf::no_type)
+        starts.push_back({s.value, 0});
+    }
+  }
+  std::ranges::sort(starts);
+
+  auto in_text = [&](size_t i) {
+    auto it = std::ranges::upper_bound(
+        text, std::pair(uint64_t(table.begin[i]), ~uint64_t(0)));
+    return it != text.begin() && table.end(i) <= std::prev(it)->second;
+  };
+  auto at_symbol = [&](size_t i) {
+    auto it = std::ranges::lower_bound(starts, uint64_t(table.begin[i]), {},
+                                       &std::pair<uint64_t, uint64_t>::first);
+    return it != starts.end() && it->first == table.begin[i];
+  };
+  auto exact = [&](size_t i) {
+    return std::ranges::binary_search(
+        starts, std::pair(uint64_t(table.begin[i]), uint64_t(table.range[i])));
+  };
+
+  std::pmr::vector<bool> dead(table.size(), false, mr);
+  for (size_t i = 0; i < table.size(); i++) {
+    if (table.end(i) <= table.begin[i] || !in_text(i) ||
+        (have_symbols && !at_symbol(i)))
+      dead[i] = true;
+  }
+
+  // settle overlaps before merging, or a row could grow into one it then
+  // loses to and take its own PCs down with it
+  auto order = table.order_by_begin(0, mr);
+  std::optional<size_t> last;
+  for (auto i : order) {
+    if (dead[i])
+      continue;
+    if (!last) {
+      last = i;
+      continue;
+    }
+    auto prev = *last;
+    if (table.begin[i] < table.end(prev)) {
+      // overlapping, only one of them describes the code that is there
+      if (exact(i) && !exact(prev)) {
+        dead[prev] = true;
+        last = i;
+      } else {
+        dead[i] = true;
+      }
+    } else {
+      last = i;
+    }
+  }
+
+  std::optional<size_t> into;
+  for (auto i : order) {
+    if (dead[i])
+      continue;
+    if (!into) {
+      into = i;
+      continue;
+    }
+    auto prev = *into;
+    if (table.begin[i] == table.end(prev) &&
+        table.state_of(i) == table.state_of(prev) && table.lsda[i] == 0 &&
+        table.lsda[prev] == 0) {
+      table.range[prev] = typename Target::address(table.end(i) -
+                                                   table.begin[prev]);
+      dead[i] = true;
+    } else {
+      into = i;
+    }
+  }
+
+  auto removed = table.erase_if([&](size_t i) { return dead[i]; });
+  timer.items(removed);
+  return removed;
+}
+
+// Drops the rows of functions no throw can unwind through, see
+// unthrown_functions. Returns how many rows were removed, which the prune
+// phase counts.
+template <typename Target>
+size_t prune_unthrown(elf::file const &e, fae::frame_table<Target> &table,
+                      diagnostics const &warn, std::pmr::memory_resource *mr) {
+  if constexpr (!std::is_same_v<Target, fae::target::avr>) {
+    warn("Only AVR code is searched for throw paths, keeping every entry");
+    return 0;
+  } else {
+    auto unthrown = unthrown_functions(e, mr, warn);
+    if (!unthrown)
+      return 0;
+    auto timer = instrument::scope(instrument::phase::prune);
+    auto dead = [&](size_t i) {
+      auto it = std::ranges::upper_bound(*unthrown, uint64_t(table.begin[i]),
+                                         {}, &code_range::begin);
+      return it != unthrown->begin() && table.end(i) <= std::prev(it)->end;
+    };
+    auto removed = table.erase_if(dead);
+    timer.items(removed);
+    return removed;
+  }
+}
+
+// Takes the rows that only pop the return address out of table and returns
+// the PCs they covered as sorted ranges, adjacent ones merged. The unwinder
+// falls back to those, see fae::trivial_index.
+template <typename Target>
+std::pmr::vector<fae::pc_range_for<Target>>
+split_trivial(fae::frame_table<Target> &table, std::pmr::memory_resource *mr) {
+  auto trivial = [&](size_t i) {
+    auto &s = table.state_of(i);
+    return s.length == 0 && table.lsda[i] == 0 &&
+           s.frame_reg == Target::stack_pointer;
+  };
+  std::pmr::vector<fae::pc_range_for<Target>> ranges(mr);
+  for (size_t i = 0; i < table.size(); i++) {
+    if (trivial(i))
+      ranges.push_back({table.begin[i], table.end(i)});
+  }
+  if (ranges.empty())
+    return ranges;
+  table.erase_if(trivial);
+  std::ranges::sort(ranges, {}, &fae::pc_range_for<Target>::begin);
+  size_t kept = 0;
+  for (size_t i = 1; i < ranges.size(); i++) {
+    if (ranges[i].begin <= ranges[kept].end)
+      ranges[kept].end = std::max(ranges[kept].end, ranges[i].end);
+    else
+      ranges[++kept] = ranges[i];
+  }
+  ranges.resize(kept + 1);
+  return ranges;
+}
+
+template <typename Target>
+std::vector<uint8_t>
+create_fae_obj(elf::file &obj, table_builder<Target> &builder,
+               std::span<prebuilt<Target>> parts, profile const *counts,
+               bool throw_paths_only, diagnostics const &warn,
+               std::pmr::memory_resource *mr) {
+  using entry = fae::table_entry_for<Target>;
+  auto &table = builder.table;
+  auto &unwind_data = builder.unwind_data;
+  intern_parts(parts, unwind_data, table, mr);
+  // before prune_entries merges neighbours across function boundaries
+  size_t pruned = 0;
+  if (throw_paths_only)
+    pruned += prune_unthrown<Target>(obj, table, warn, mr);
+  pruned += prune_entries<Target>(obj, table, mr);
+  auto trivial = split_trivial<Target>(table, mr);
+  // unwinders binary search the entries, and neither .eh_frame nor the parts
+  // appended after its rows come sorted
+  uint16_t hot = 0;
+  if (counts)
+    hot = order_by_profile<Target>(table, *counts, mr);
+  else
+    table.permute(table.order_by_begin(0, mr));
+  // this also leaves out the programs only dropped entries used
+  if (counts || pruned != 0)
+    order_programs<Target>(table, unwind_data, mr);
+  auto features = fae::features_of(unwind_data);
+  if (hot != 0)
+    features |= fae::hot_entries;
+  if (!trivial.empty())
+    features |= fae::trivial_ranges;
+
+  // .fae_data goes right after .text, where the linker aligns it for the
+  // entries
+  auto &text = obj.get_section(".text");
+  auto text_end = text.address + text.data.size();
+  uint32_t addr = cast<uint32_t>((text_end + alignof(entry) - 1) /
+                                 alignof(entry) * alignof(entry));
+  uint32_t offset = addr + fae::entries_offset<Target>(features) +
+                    table.size() * sizeof(entry) +
+                    trivial.size() * sizeof(trivial[0]);
+  auto elf = create_obj<Target>(obj.flags);
+  auto align = alignof(entry);
+  auto file_offset = elf.header_size() + elf.get_section(1).data.size();
+  elf.sections.push_back(create_fae_section<Target>(
+      addr, offset, table, hot, trivial, features, unwind_data,
+      (file_offset + align - 1) / align * align, mr));
+  return elf::serialize(elf);
+}
+
+// Collects the entries faegen --object left in a linked file. Entries of
+// functions the linker discarded have their PCs resolved to 0 and are
+// dropped.
+template <typename Target>
+std::pmr::vector<prebuilt<Target>> read_parts(elf::file const &e,
+                                              std::pmr::memory_resource *mr) {
+  using entry = fae::table_entry_for<Target>;
+  std::pmr::vector<prebuilt<Target>> result(mr);
+  auto scn = e.find_section(".fae_part");
+  if (!scn)
+    return result;
+  auto r = Reader(scn->data);
+  while (!r.empty()) {
+    auto chunk = r.bytes_read;
+    auto header = r.consume<fae::part_header>();
+    // all eight bytes, a corrupt chunk needn't have its NUL
+    if (std::string_view(header.header, sizeof header.header) !=
+        "faepart\0"sv) {
+      throw std::runtime_error(fmt::format(
+          ".fae_part chunk at {:#x} has a bad header", chunk));
+    }
+    auto entries =
+        std::span(reinterpret_cast<const entry *>(r.begin), header.entries);
+    r.increment(entries.size_bytes());
+    auto insts = std::span(reinterpret_cast<const fae::frame_inst *>(r.begin),
+                           header.insts);
+    auto padding = (alignof(entry) - insts.size_bytes() % alignof(entry)) %
+                   alignof(entry);
+    r.increment(insts.size_bytes() + padding);
+    for (auto &entry : entries) {
+      if (entry.pc_begin == 0)
+        continue;
+      if (entry.data + entry.length > insts.size())
+        throw std::out_of_range("frame_inst of a .fae_part entry out of range");
+      result.push_back({entry, insts.subspan(entry.data, entry.length)});
+    }
+  }
+  return result;
+}
+
+// The relocation types that write an absolute address as wide as the
+// target's, see fae::dispatch_target
+elf::u32 address_relocation(elf::machine_type m) {
+  switch (m) {
+  case elf::machine_type::avr:
+    return 4; // R_AVR_16
+  case elf::machine_type::msp430:
+    return 5; // R_MSP430_16_BYTE
+  case elf::machine_type::arm:
+    return 2; // R_ARM_ABS32
+  default:
+    throw std::runtime_error(
+        fmt::format("no address relocation known for {}", m));
+  }
+}
+
+void append_sections(elf::file &obj, std::span<elf::section> sections) {
+  obj.sections.reserve(obj.sections.size() + sections.size());
+  auto &strtab = obj.get_section(obj.sh_str_index);
+  std::pmr::vector<uint32_t> offsets(obj.sections.get_allocator());
+  for (auto &sh : sections) {
+    offsets.push_back(uint32_t(strtab.data.size()));
+    strtab.data.insert(strtab.data.end(), sh.name.begin(), sh.name.end());
+    strtab.data.push_back(0);
+  }
+  // the string table grew, so it moves after everything else
+  elf::u64 end = 0;
+  for (auto &sh : obj.sections) {
+    if (&sh != &strtab)
+      end = std::max(end, sh.file_offset + sh.data.size());
+  }
+  auto place = [&](elf::section &sh) {
+    auto align = std::max<elf::u64>(sh.alignment, 1);
+    sh.file_offset = (end + align - 1) / align * align;
+    end = sh.file_offset + sh.data.size();
+  };
+  place(strtab);
+  // name_map keeps views, so point them at the string table itself
+  auto names = reinterpret_cast<const char *>(strtab.data.data());
+  for (size_t i = 0; i < sections.size(); i++) {
+    auto &sh = sections[i];
+    place(sh);
+    obj.name_map.insert(
+        {std::string_view(names + offsets[i], sh.name.size()), offsets[i]});
+    obj.sections.push_back(std::move(sh));
+  }
+}
+
+// Encodes an unlinked object's FDEs into a .fae_part chunk and appends it to
+// the object together with relocations for the PC and LSDA fields. frames is
+// consumed before anything is added to obj.
+template <typename Target>
+void add_fae_part(elf::file &obj, tl::generator<frame> frames,
+                  diagnostics const &warn, std::pmr::memory_resource *mr) {
+  using entry_t = fae::table_entry_for<Target>;
+  auto &eh_frame = obj.get_section(".eh_frame");
+  auto eh_index = obj.index_of(eh_frame);
+  elf::section const *eh_relocs = nullptr;
+  for (auto &sh : obj.sections) {
+    if ((sh.type == elf::sh::rela || sh.type == elf::sh::rel) &&
+        sh.info == eh_index)
+      eh_relocs = &sh;
+  }
+  if (!eh_relocs)
+    throw std::runtime_error(".eh_frame has no relocations");
+  auto reloc_type = eh_relocs->type;
+  auto symtab = eh_relocs->link;
+  auto relocs = elf::read_relocations(obj, *eh_relocs, mr);
+  std::ranges::sort(relocs, {}, &elf::relocation::offset);
+
+  // target of the relocated field, as symbol + addend
+  auto target = [&](uint64_t field) -> std::optional<elf::relocation> {
+    auto it = std::ranges::lower_bound(relocs, field, {},
+                                       &elf::relocation::offset);
+    if (it == relocs.end() || it->offset != field)
+      return std::nullopt;
+    auto result = *it;
+    if (reloc_type == elf::sh::rel) {
+      int32_t implicit;
+      std::memcpy(&implicit, eh_frame.data.data() + field, sizeof(implicit));
+      result.addend = implicit;
+    }
+    return result;
+  };
+
+  table_builder<Target> builder(mr);
+  auto type = address_relocation(obj.machine);
+  std::pmr::vector<entry_t> entries(mr);
+  std::pmr::vector<elf::relocation> out_relocs(mr);
+  auto relocate = [&](size_t field, elf::relocation const &to,
+                      int64_t extra) {
+    out_relocs.push_back({.offset = field,
+                          .symbol = to.symbol,
+                          .type = type,
+                          .addend = to.addend + extra});
+  };
+  for (auto &f : frames) {
+    if (!encodable<Target>(f, warn))
+      continue;
+    auto begin = target(f.begin_field);
+    if (!begin) {
+      warn(fmt::format("FDE pc_begin at {:#x} has no relocation",
+                       f.begin_field));
+      continue;
+    }
+    auto entry = builder.table.to_entry(builder.add(f), 0);
+    auto at = sizeof(fae::part_header) + entries.size() * sizeof(entry_t);
+    relocate(at + offsetof(entry_t, pc_begin), *begin, 0);
+    relocate(at + offsetof(entry_t, pc_end), *begin, f.range);
+    entry.pc_begin = entry.pc_end = entry.lsda = 0;
+    if (f.lsda_field != 0) {
+      if (auto lsda = target(f.lsda_field)) {
+        relocate(at + offsetof(entry_t, lsda), *lsda, 0);
+      }
+    }
+    entries.push_back(entry);
+  }
+  if (reloc_type == elf::sh::rel) {
+    // REL keeps addends in the data
+    for (auto &r : out_relocs) {
+      auto index = (r.offset - sizeof(fae::part_header)) / sizeof(entry_t);
+      auto field = (r.offset - sizeof(fae::part_header)) % sizeof(entry_t);
+      auto value = typename Target::address(r.addend);
+      std::memcpy(reinterpret_cast<uint8_t *>(&entries[index]) + field,
+                  &value, sizeof(value));
+      r.addend = 0;
+    }
+  }
+
+  auto &unwind_data = builder.unwind_data;
+  std::pmr::vector<uint8_t> chunk(mr);
+  auto writer = write_vector(chunk);
+  writer.write(fae::part_header{.entries = cast16(entries.size()),
+                                .insts = cast16(unwind_data.size())});
+  writer.write(entries);
+  writer.write(unwind_data);
+  while (chunk.size() % alignof(entry_t))
+    chunk.push_back(0);
+
+  auto rel_name = reloc_type == elf::sh::rela ? ".rela.fae_part"
+                                              : ".rel.fae_part";
+  std::array<elf::section, 2> added = {
+      elf::section{.name = std::pmr::string(".fae_part", mr),
+                   .type = elf::sh::prog_bit,
+                   .file_offset = 0,
+                   .data = std::move(chunk),
+                   .alignment = alignof(entry_t)},
+      elf::section{
+          .name = std::pmr::string(rel_name, mr),
+          .type = reloc_type,
+          .flags = elf::sh::info_link,
+          .file_offset = 0,
+          .data = elf::write_relocations(obj, reloc_type, out_relocs, mr),
+          .link = symtab,
+          .info = uint32_t(obj.sections.size()),
+          .alignment = obj.format == elf::e32 ? 4u : 8u,
+          .entry_size = eh_relocs->entry_size}};
+  append_sections(obj, added);
+}
+template <typename Target>
+std::optional<std::vector<uint8_t>> generate(generate_options const &o,
+                                             elf::file &e, cie_cache *cies,
+                                             std::pmr::memory_resource *mr) {
+  if (o.object_mode) {
+    if (e.type != elf::rel) {
+      throw std::runtime_error(
+          fmt::format("{} is not a relocatable object", o.name));
+    }
+    // nothing to do without unwind info, or if this already ran
+    if (!e.find_section(".eh_frame") || e.find_section(".fae_part"))
+      return std::nullopt;
+    add_fae_part<Target>(e, each_frame(e, mr, {}, cies, o.warn), o.warn, mr);
+    return elf::serialize(e);
+  }
+
+  // FDEs already encoded at compile time only need their header decoded
+  auto parts = read_parts<Target>(e, mr);
+  std::pmr::vector<int64_t> covered(mr);
+  covered.reserve(parts.size());
+  for (auto &p : parts)
+    covered.push_back(p.entry.pc_begin);
+  std::ranges::sort(covered);
+  // a frame is gone as soon as it has been encoded, freeing it through a
+  // pool lets the next one reuse its memory
+  std::pmr::unsynchronized_pool_resource pool(mr);
+  table_builder<Target> builder(&pool);
+  auto frames = each_frame(
+      e, &pool,
+      [&](int64_t begin) { return !std::ranges::binary_search(covered, begin); },
+      cies, o.warn);
+  for (auto &f : frames) {
+    if (encodable<Target>(f, o.warn))
+      builder.add(f);
+  }
+  instrument::note_buffer("entries", builder.table.capacity_bytes());
+  std::optional<profile> counts;
+  if (!o.profile.empty())
+    counts = parse_profile(o.profile, o.profile_name, mr);
+  return create_fae_obj<Target>(e, builder, parts,
+                                counts ? &*counts : nullptr,
+                                o.throw_paths_only, o.warn, mr);
+}
+
+} // namespace
+
+std::optional<std::vector<uint8_t>> generate_fae(std::span<uint8_t> n,
+                                                 generate_options const &o,
+                                                 cie_cache *cies) {
+  // everything derived from the input lives here and is freed in one go; the
+  // section copies alone are about the size of the file
+  std::pmr::monotonic_buffer_resource arena(n.size() * 2);
+  auto e = elf::parse_buffer(n, &arena);
+  return fae::dispatch_target(e.machine, [&](auto t) {
+    return generate<decltype(t)>(o, e, cies, &arena);
+  });
+}
+
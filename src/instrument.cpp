@@ -0,0 +1,244 @@
+#include "instrument.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fmt/core.h>
+#include <optional>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace instrument {
+namespace {
+struct totals {
+  uint64_t calls = 0, items = 0;
+  detail::clock::duration time{};
+  perf::values counts{};
+};
+
+struct event {
+  phase p;
+  detail::clock::time_point begin, end;
+  uint64_t items;
+  perf::values counts;
+};
+
+// Everything below is per thread, so each thread of faegen --serve reports
+// only the job it ran
+thread_local std::array<totals, phase_count> phases;
+thread_local std::vector<event> events;
+thread_local detail::clock::time_point epoch;
+thread_local std::optional<perf::counters> counters;
+
+perf::counters &thread_counters() {
+  if (!counters)
+    counters.emplace();
+  return *counters;
+}
+
+// the events to report, empty unless counting
+std::vector<perf::event> counted_events() {
+  std::vector<perf::event> result;
+  if (!detail::counting)
+    return result;
+  for (size_t i = 0; i < perf::event_count; i++) {
+    if (thread_counters().available(perf::event(i)))
+      result.push_back(perf::event(i));
+  }
+  return result;
+}
+
+// slot 0 is for allocations outside of any scope
+struct allocations {
+  std::atomic<uint64_t> count{0}, bytes{0};
+};
+thread_local std::array<allocations, phase_count + 1> memory;
+
+struct buffer {
+  std::string_view name;
+  uint64_t count = 0, bytes = 0, largest = 0;
+};
+thread_local std::vector<buffer> buffers;
+
+double micros(detail::clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+void report_table(std::FILE *out) {
+  auto shown = counted_events();
+  bool ipc = detail::counting &&
+             thread_counters().available(perf::event::cycles) &&
+             thread_counters().available(perf::event::instructions);
+  if (detail::counting && shown.empty())
+    fmt::println(out, "no event counters available, wall time only");
+  fmt::print(out, "{:<20} {:>8} {:>12} {:>12} {:>12}", "phase", "calls",
+             "items", "total ms", "avg us");
+  for (auto e : shown)
+    fmt::print(out, " {:>14}", format_as(e));
+  fmt::println(out, "{}", ipc ? fmt::format(" {:>6}", "IPC") : "");
+  for (size_t i = 0; i < phase_count; i++) {
+    auto &t = phases[i];
+    if (t.calls == 0)
+      continue;
+    fmt::print(out, "{:<20} {:>8} {:>12} {:>12.3f} {:>12.3f}",
+               format_as(phase(i)), t.calls, t.items, micros(t.time) / 1000,
+               micros(t.time) / t.calls);
+    for (auto e : shown)
+      fmt::print(out, " {:>14}", t.counts[size_t(e)]);
+    if (ipc) {
+      auto m = perf::measurement{.counts = t.counts, .wall = t.time};
+      fmt::print(out, " {:>6.2f}", m.ipc());
+    }
+    fmt::println(out, "");
+  }
+}
+
+void report_trace(std::FILE *out) {
+  fmt::print(out, "{{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  auto shown = counted_events();
+  bool first = true;
+  for (auto &e : events) {
+    fmt::print(out,
+               "{}\n{{\"name\":\"{}\",\"cat\":\"faegen\",\"ph\":\"X\","
+               "\"pid\":1,\"tid\":1,\"ts\":{:.3f},\"dur\":{:.3f},"
+               "\"args\":{{\"items\":{}",
+               first ? "" : ",", format_as(e.p), micros(e.begin - epoch),
+               micros(e.end - e.begin), e.items);
+    for (auto c : shown)
+      fmt::print(out, ",\"{}\":{}", format_as(c), e.counts[size_t(c)]);
+    fmt::print(out, "}}}}");
+    first = false;
+  }
+  fmt::println(out, "\n]}}");
+}
+// in KiB, 0 if unknown
+uint64_t peak_rss() {
+#ifndef _WIN32
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#else
+  return 0;
+#endif
+}
+} // namespace
+
+mode detail::current = mode::off;
+bool detail::track_memory = false;
+bool detail::counting = false;
+thread_local int8_t detail::current_phase = -1;
+
+void detail::count_allocation(size_t bytes) noexcept {
+  auto &slot = memory[current_phase + 1];
+  slot.count.fetch_add(1, std::memory_order_relaxed);
+  slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void enable_memory() { detail::track_memory = true; }
+
+void note_buffer(std::string_view name, size_t bytes) noexcept {
+  if (!memory_enabled())
+    return;
+  auto it = std::find_if(buffers.begin(), buffers.end(),
+                         [&](auto &b) { return b.name == name; });
+  if (it == buffers.end()) {
+    // no allocation worth reporting fails here, and a lost line is harmless
+    try {
+      it = buffers.insert(buffers.end(), {name});
+    } catch (...) {
+      return;
+    }
+  }
+  it->count++;
+  it->bytes += bytes;
+  it->largest = std::max<uint64_t>(it->largest, bytes);
+}
+
+void report_memory(std::FILE *out) {
+  if (!memory_enabled())
+    return;
+  fmt::println(out, "{:<20} {:>10} {:>14}", "phase", "allocs", "bytes");
+  for (size_t i = 0; i < memory.size(); i++) {
+    auto count = memory[i].count.load(std::memory_order_relaxed);
+    if (count == 0)
+      continue;
+    fmt::println(out, "{:<20} {:>10} {:>14}",
+                 i == 0 ? "(outside phases)" : format_as(phase(i - 1)), count,
+                 memory[i].bytes.load(std::memory_order_relaxed));
+  }
+  fmt::println(out, "\n{:<20} {:>10} {:>14} {:>14}", "buffer", "count",
+               "bytes", "largest");
+  for (auto &b : buffers)
+    fmt::println(out, "{:<20} {:>10} {:>14} {:>14}", b.name, b.count, b.bytes,
+                 b.largest);
+  if (auto rss = peak_rss())
+    fmt::println(out, "\npeak RSS: {} KiB", rss);
+}
+
+void detail::record(phase p, clock::time_point begin, clock::time_point end,
+                    uint64_t items, perf::values const *counts) noexcept {
+  auto &t = phases[size_t(p)];
+  t.calls++;
+  t.items += items;
+  t.time += end - begin;
+  if (counts) {
+    for (size_t i = 0; i < counts->size(); i++)
+      t.counts[i] += (*counts)[i];
+  }
+  if (current == mode::trace) {
+    try {
+      events.push_back(
+          {p, begin, end, items, counts ? *counts : perf::values{}});
+    } catch (...) {
+      // losing a trace event is better than losing the link
+    }
+  }
+}
+
+void enable(mode m) {
+  detail::current = m;
+  epoch = detail::clock::now();
+}
+
+perf::values detail::read_counters() noexcept {
+  return thread_counters().read();
+}
+
+void enable_counters() {
+  thread_counters();
+  detail::counting = true;
+}
+
+void reset() noexcept {
+  phases = {};
+  events.clear();
+  for (auto &slot : memory) {
+    slot.count.store(0, std::memory_order_relaxed);
+    slot.bytes.store(0, std::memory_order_relaxed);
+  }
+  buffers.clear();
+  epoch = detail::clock::now();
+}
+
+void report(std::FILE *out) {
+  switch (detail::current) {
+  case mode::off:
+    return;
+  case mode::table:
+    report_table(out);
+    return;
+  case mode::trace:
+    report_trace(out);
+    return;
+  }
+}
+
+} // namespace instrument
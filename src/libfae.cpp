@@ -0,0 +1,164 @@
+#include "libfae.h"
+
+#include "fae.hpp"
+#include "fae_table.hpp"
+#include "generate.hpp"
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace {
+thread_local std::string last_error;
+// one line per message, the host decides whether anyone sees them
+thread_local std::string last_warnings;
+
+void add_warning(std::string_view message) {
+  last_warnings.append(message);
+  last_warnings += '\n';
+}
+
+fae_status fail(fae_status status, std::string_view message) noexcept {
+  try {
+    last_error = message;
+  } catch (...) {
+    last_error.clear();
+  }
+  return status;
+}
+
+// Runs f, turning whatever it throws into a status
+template <typename F> fae_status guarded(F &&f) noexcept {
+  try {
+    last_error.clear();
+    last_warnings.clear();
+    return f();
+  } catch (std::bad_alloc const &) {
+    return fail(FAE_OUT_OF_MEMORY, "out of memory");
+  } catch (std::exception const &e) {
+    return fail(FAE_BAD_INPUT, e.what());
+  } catch (...) {
+    return fail(FAE_BAD_INPUT, "unknown error");
+  }
+}
+
+// parse_buffer only reads its input, it copies what it keeps
+std::span<uint8_t> input_span(const uint8_t *input, size_t size) {
+  return {const_cast<uint8_t *>(input), size};
+}
+
+template <typename Target>
+fae_status decode(elf::file const &e, fae_table &table) {
+  auto [entries, data, offset, hot, trivial] = fae::read_fae<Target>(e);
+  table.entry_count = entries.size() + trivial.size();
+  table.hot_count = hot;
+  table.inst_count = data.size();
+  table.machine = uint16_t(e.machine);
+  if (table.entry_count > table.entries_capacity ||
+      data.size() > table.insts_capacity)
+    return fail(FAE_BUFFER_TOO_SMALL, "the table doesn't fit the buffers");
+
+  for (size_t i = 0; i < entries.size(); i++) {
+    auto &from = entries[i];
+    table.entries[i] = {.pc_begin = from.pc_begin,
+                        .pc_end = from.pc_end,
+                        .lsda = from.lsda,
+                        .insts = from.length ? uint32_t(from.data - offset) : 0,
+                        .length = from.length,
+                        .frame_reg = from.frame_reg};
+  }
+  // ranges become entries that only pop the return address
+  for (size_t i = 0; i < trivial.size(); i++) {
+    table.entries[entries.size() + i] = {.pc_begin = trivial[i].begin,
+                                         .pc_end = trivial[i].end,
+                                         .lsda = 0,
+                                         .insts = 0,
+                                         .length = 0,
+                                         .frame_reg = Target::stack_pointer};
+  }
+  std::stable_sort(table.entries + hot, table.entries + table.entry_count,
+                   [](auto const &a, auto const &b) {
+                     return a.pc_begin < b.pc_begin;
+                   });
+  std::memcpy(table.insts, data.data(), data.size());
+  return FAE_OK;
+}
+} // namespace
+
+extern "C" {
+
+fae_status fae_generate(const uint8_t *input, size_t input_size,
+                        const fae_options *options, uint8_t *out,
+                        size_t out_capacity, size_t *out_size) {
+  if (!input || !out_size || (!out && out_capacity != 0))
+    return fail(FAE_INVALID_ARGUMENT, "input and out_size are required");
+  return guarded([&] {
+    generate_options o{.warn = add_warning};
+    if (options) {
+      o.object_mode = options->flags & FAE_OBJECT;
+      o.throw_paths_only = options->flags & FAE_THROW_PATHS_ONLY;
+      if (options->profile)
+        o.profile = {options->profile, options->profile_size};
+    }
+    auto result = generate_fae(input_span(input, input_size), o);
+    if (!result) {
+      *out_size = 0;
+      return FAE_NOTHING_TO_DO;
+    }
+    *out_size = result->size();
+    if (result->size() > out_capacity)
+      return fail(FAE_BUFFER_TOO_SMALL,
+                  fmt::format("the result needs {} bytes", result->size()));
+    std::memcpy(out, result->data(), result->size());
+    return FAE_OK;
+  });
+}
+
+fae_status fae_decode_table(const uint8_t *input, size_t input_size,
+                            fae_table *table) {
+  if (!input || !table || (!table->entries && table->entries_capacity) ||
+      (!table->insts && table->insts_capacity))
+    return fail(FAE_INVALID_ARGUMENT, "input and table are required");
+  return guarded([&] {
+    auto e = elf::parse_buffer(input_span(input, input_size));
+    return fae::dispatch_target(e.machine, [&](auto t) {
+      return decode<decltype(t)>(e, *table);
+    });
+  });
+}
+
+fae_status fae_lookup_pc(const fae_table *table, uint64_t pc,
+                         const fae_entry **entry) {
+  if (!table || !entry || (!table->entries && table->entry_count) ||
+      table->hot_count > table->entry_count)
+    return fail(FAE_INVALID_ARGUMENT, "table and entry are required");
+  last_error.clear();
+  last_warnings.clear();
+  auto entries = std::span(table->entries, table->entry_count);
+  auto covers = [&](fae_entry const &e) {
+    return pc >= e.pc_begin && pc < e.pc_end;
+  };
+  for (auto &e : entries.first(table->hot_count)) {
+    if (covers(e)) {
+      *entry = &e;
+      return FAE_OK;
+    }
+  }
+  auto rest = entries.subspan(table->hot_count);
+  auto it = std::upper_bound(rest.begin(), rest.end(), pc,
+                             [](uint64_t pc, fae_entry const &e) {
+                               return pc < e.pc_begin;
+                             });
+  if (it == rest.begin() || !covers(*std::prev(it)))
+    return FAE_NOT_FOUND;
+  *entry = &*std::prev(it);
+  return FAE_OK;
+}
+
+const char *fae_last_error(void) { return last_error.c_str(); }
+
+const char *fae_last_warnings(void) { return last_warnings.c_str(); }
+}
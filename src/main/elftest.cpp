@@ -1,16 +1,252 @@
 #include "elf/elf.hpp"
 #include "external/ctre/ctre.hpp"
+#include "instrument.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <filesystem>
 #include <fmt/core.h>
 #include <fmt/format.h>
 #include <fmt/ranges.h>
 #include <io.hpp>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace {
+namespace fs = std::filesystem;
+
+struct loaded {
+  std::string path;
+  std::vector<uint8_t> data;
+  std::string error; // set if the file couldn't be read
+};
+
+// Files read ahead of the workers. Bounded by bytes so a corpus of large
+// images doesn't end up in memory all at once.
+class file_queue {
+public:
+  static constexpr size_t max_bytes = 256 << 20;
+
+  void push(std::vector<loaded> batch) {
+    size_t size = 0;
+    for (auto &f : batch)
+      size += f.data.size();
+    std::unique_lock lock(m);
+    // a single oversized batch still has to go through
+    has_room.wait(lock, [&] { return bytes == 0 || bytes + size <= max_bytes; });
+    bytes += size;
+    for (auto &f : batch)
+      files.push_back(std::move(f));
+    has_files.notify_all();
+  }
+
+  // nullopt once the reader is done and everything was taken
+  std::optional<loaded> pop() {
+    std::unique_lock lock(m);
+    has_files.wait(lock, [&] { return !files.empty() || closed; });
+    if (files.empty())
+      return std::nullopt;
+    auto f = std::move(files.front());
+    files.pop_front();
+    bytes -= f.data.size();
+    has_room.notify_one();
+    return f;
+  }
+
+  void close() {
+    std::lock_guard lock(m);
+    closed = true;
+    has_files.notify_all();
+  }
+
+private:
+  std::mutex m;
+  std::condition_variable has_files, has_room;
+  std::deque<loaded> files;
+  size_t bytes = 0;
+  bool closed = false;
+};
+
+// Unlike read_file this only needs read access, vendor trees often are
+// read-only
+loaded load(std::string path) {
+  loaded result{.path = std::move(path), .data = {}, .error = {}};
+  auto f = std::fopen(result.path.c_str(), "rb");
+  if (!f) {
+    result.error = "could not open";
+    return result;
+  }
+  std::fseek(f, 0, SEEK_END);
+  result.data.resize(std::ftell(f));
+  std::fseek(f, 0, SEEK_SET);
+  if (std::fread(result.data.data(), 1, result.data.size(), f) !=
+      result.data.size())
+    result.error = "short read";
+  std::fclose(f);
+  return result;
+}
+
+std::vector<std::string> scan(std::span<const char *const> roots) {
+  std::vector<std::string> paths;
+  for (auto root : roots) {
+    if (!fs::is_directory(root)) {
+      paths.emplace_back(root);
+      continue;
+    }
+    for (auto &entry : fs::recursive_directory_iterator(
+             root, fs::directory_options::skip_permission_denied)) {
+      if (entry.is_regular_file())
+        paths.push_back(entry.path().string());
+    }
+  }
+  // a stable order keeps the failure list diffable between runs
+  std::ranges::sort(paths);
+  return paths;
+}
+
+struct corpus_result {
+  std::atomic<uint64_t> files{0}, bytes{0}, skipped{0};
+  std::mutex failures_lock;
+  std::vector<std::pair<std::string, std::string>> failures;
+
+  void fail(std::string path, std::string why) {
+    std::lock_guard lock(failures_lock);
+    failures.emplace_back(std::move(path), std::move(why));
+  }
+};
+
+// Empty if the file survives parse_buffer and serialize bit for bit
+std::string round_trip(std::span<uint8_t> file) {
+  std::pmr::monotonic_buffer_resource arena(file.size() * 2);
+  auto result = elf::serialize(elf::parse_buffer(file, &arena));
+  if (result.size() != file.size())
+    return fmt::format("size {} became {}", file.size(), result.size());
+  auto [a, b] = std::ranges::mismatch(file, result);
+  if (a != file.end())
+    return fmt::format("differs at {:#x}", a - file.begin());
+  return {};
+}
+
+void round_trip_worker(file_queue &queue, corpus_result &out) {
+  while (auto f = queue.pop()) {
+    if (!f->error.empty()) {
+      out.fail(f->path, f->error);
+      continue;
+    }
+    if (f->data.size() < 4 ||
+        !std::ranges::equal(std::span(f->data).first(4),
+                            std::array<uint8_t, 4>{0x7f, 'E', 'L', 'F'})) {
+      out.skipped++;
+      continue;
+    }
+    out.files++;
+    out.bytes += f->data.size();
+    try {
+      if (auto why = round_trip(f->data); !why.empty())
+        out.fail(f->path, why);
+    } catch (std::exception const &e) {
+      out.fail(f->path, e.what());
+    }
+  }
+}
+
+// Round-trips every file under roots on jobs threads while one thread reads
+// ahead in batches. Nothing is written to disk. Returns the number of
+// failures.
+size_t run_corpus(std::span<const char *const> roots, unsigned jobs) {
+  constexpr size_t batch_files = 64;
+  constexpr size_t batch_bytes = 16 << 20;
+  auto start = std::chrono::steady_clock::now();
+  auto paths = scan(roots);
+
+  file_queue queue;
+  corpus_result result;
+  std::jthread reader([&] {
+    std::vector<loaded> batch;
+    size_t bytes = 0;
+    for (auto &path : paths) {
+      batch.push_back(load(path));
+      bytes += batch.back().data.size();
+      if (batch.size() == batch_files || bytes >= batch_bytes) {
+        queue.push(std::move(batch));
+        batch.clear();
+        bytes = 0;
+      }
+    }
+    queue.push(std::move(batch));
+    queue.close();
+  });
+  {
+    std::vector<std::jthread> workers;
+    for (unsigned i = 0; i < jobs; i++)
+      workers.emplace_back([&] { round_trip_worker(queue, result); });
+  }
+  reader.join();
+
+  std::chrono::duration<double> seconds =
+      std::chrono::steady_clock::now() - start;
+  auto mb = double(result.bytes) / 1e6;
+  fmt::println("{} files ({} not ELF), {:.1f} MB in {:.3f} s on {} threads",
+               result.files.load(), result.skipped.load(), mb,
+               seconds.count(), jobs);
+  fmt::println("{:.1f} files/s, {:.1f} MB/s",
+               result.files / seconds.count(), mb / seconds.count());
+  std::ranges::sort(result.failures);
+  fmt::println("{} parity failures", result.failures.size());
+  for (auto &[path, why] : result.failures)
+    fmt::println("  {}: {}", path, why);
+  return result.failures.size();
+}
+
+void print_usage() {
+  fmt::println(stderr, "usage: elftest [--mem-report] <file>\n"
+                       "       elftest [--mem-report] [-j N] --corpus "
+                       "<dir or file>...");
+}
+} // namespace
 
 int main(int argc, char **argv) {
-  assert(argc == 2);
-  assert(ctre::match<R"(.+(:?\.o|\.elf))">(argv[1]));
-  auto file = read_file(argv[1]);
+  bool corpus = false;
+  unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+  int first = 1;
+  for (; first < argc; first++) {
+    auto arg = std::string_view(argv[first]);
+    if (arg == "--mem-report") {
+      instrument::enable_memory();
+    } else if (arg == "--corpus") {
+      corpus = true;
+    } else if (arg == "-j" && first + 1 < argc) {
+      auto n = std::string_view(argv[++first]);
+      auto [end, ec] = std::from_chars(n.data(), n.data() + n.size(), jobs);
+      if (ec != std::errc{} || end != n.data() + n.size() || jobs == 0) {
+        print_usage();
+        return 1;
+      }
+    } else {
+      break;
+    }
+  }
+  if (corpus && first < argc) {
+    auto failures = run_corpus(std::span(argv + first, argv + argc), jobs);
+    instrument::report_memory(stderr);
+    return failures == 0 ? 0 : 1;
+  }
+  if (corpus || first != argc - 1) {
+    print_usage();
+    return 1;
+  }
+
+  auto input = argv[first];
+  assert(ctre::match<R"(.+(:?\.o|\.elf))">(input));
+  auto file = read_file(input);
   auto elf = elf::parse_buffer(file);
 
   auto result = elf::serialize(elf);
@@ -36,4 +272,5 @@ int main(int argc, char **argv) {
         i++, sh.name, sh.type, sh.address, sh.file_offset, sh.data.size(),
         sh.entry_size, sh.flags, sh.link, sh.info, sh.alignment);
   }
-}
\ No newline at end of file
+  instrument::report_memory(stderr);
+}
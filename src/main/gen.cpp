@@ -1,184 +1,338 @@
-#include "binary_parsing.hpp"
-#include "elf/elf.hpp"
 #include "external/ctre/ctre.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
-#include <fmt/ranges.h>
-#include <functional>
-#include <limits>
-#include <map>
-#include <ranges>
+#include <filesystem>
+#include <fmt/core.h>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <span>
 #include <stdexcept>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
-#include "fae.hpp"
+#include "generate.hpp"
+#include "instrument.hpp"
 #include "io.hpp"
-#include "parse.hpp"
-
-using unwind_ref = std::reference_wrapper<const callstack>;
-template <> struct std::hash<unwind_ref> {
-  std::size_t operator()(unwind_ref map) const noexcept {
-    size_t hash = 0;
-    for (auto &&[k, v] : map.get().register_offsets) {
-      // this needs to be commutative since unordered_map is unordered
-      hash ^= k + 0x9e3779b9 + (v << 6) + (v >> 2);
-    }
-    hash = hash + 0x9e3779b9 + (map.get().cfa_offset << 6) +
-           (map.get().cfa_offset >> 2);
-    hash = hash + 0x9e3779b9 + (map.get().cfa_register << 6) +
-           (map.get().cfa_register >> 2);
-    return hash;
-  }
-};
+#include "serve.hpp"
 
 namespace {
-using namespace std::string_view_literals;
+// "-" prints a table to stderr, anything else is a path for a Chrome trace
+std::string_view time_report;
 
-uint16_t cast16(int64_t i) {
-  if (i > std::numeric_limits<uint16_t>::max()) {
-    throw std::out_of_range(fmt::format("cast16: {} is out of range", i));
+void print_reports() {
+  instrument::report_memory(stderr);
+  if (time_report.empty())
+    return;
+  if (time_report == "-") {
+    instrument::report(stderr);
+    return;
   }
-  return static_cast<uint16_t>(i);
-}
-uint8_t cast8(int64_t i) {
-  if (i > std::numeric_limits<uint8_t>::max()) {
-    throw std::out_of_range(fmt::format("cast16: {} is out of range", i));
+  auto f = fopen(time_report.data(), "w");
+  if (!f) {
+    fmt::println(stderr, "could not open {} for the time report", time_report);
+    return;
   }
-  return static_cast<uint8_t>(i);
+  instrument::report(f);
+  fclose(f);
 }
-struct unwind_range {
-  uint16_t data;
-  uint8_t size;
+
+struct job {
+  std::string input;
+  std::string output;
+  bool object_mode = false;
+  // these two only when linking
+  std::string profile;
+  bool throw_paths_only = false;
 };
 
-std::vector<fae::frame_inst>
-create_data(std::unordered_map<unwind_ref, unwind_range> &out) {
-  std::vector<fae::frame_inst> result;
-  for (auto &&[unwind, range] : out) {
-    range.data = result.size();
-    std::map<int64_t, int32_t> offset_to_reg;
-    for (auto &&[reg, offset] : unwind.get().register_offsets) {
-      if (reg < 32)
-        offset_to_reg.insert(
-            {offset * -1 - 2 + 1, reg}); // stack grows downwards
-    }
+// The file to write to job.output, or nullopt if there is nothing to do
+std::optional<std::vector<uint8_t>> generate(job const &j,
+                                             std::span<uint8_t> n,
+                                             cie_cache *cies) {
+  std::vector<uint8_t> profile;
+  if (!j.profile.empty())
+    profile = read_file(j.profile);
+  return generate_fae(
+      n,
+      {.object_mode = j.object_mode,
+       .name = j.input,
+       .profile = {reinterpret_cast<const char *>(profile.data()),
+                   profile.size()},
+       .profile_name = j.profile,
+       .throw_paths_only = j.throw_paths_only,
+       .warn = print_diagnostic},
+      cies);
+}
 
-    int32_t stack = unwind.get().cfa_offset * -1 - 2;
-    while (stack != 0 && !offset_to_reg.empty()) {
-      auto [back_off, back_reg] = *offset_to_reg.rbegin();
-      if (stack == back_off) {
-        result.push_back({fae::enumerate(back_reg)});
-        offset_to_reg.erase(back_off);
-        stack--;
-      } else {
-        uint32_t needed_stack = stack - back_off;
-        while (needed_stack > 0) {
-          uint32_t skipped_stack =
-              std::min(needed_stack, fae::skip::max_skip_bytes);
-          result.push_back({fae::skip(skipped_stack)});
-          needed_stack -= skipped_stack;
-        }
-        stack -= stack - back_off;
-      }
-    }
-    if (stack != 0) {
-      result.push_back({fae::skip(stack)});
-    }
+// What faegen --serve keeps between jobs. The intern tables themselves are
+// rebuilt per job since their offsets depend on the output; unchanged inputs
+// skip them entirely through the result cache. Jobs run concurrently, lock
+// guards results and cached_bytes, cies locks itself.
+struct warm_state {
+  cie_cache cies;
+  std::mutex lock;
+  struct result {
+    bool object_mode;
+    bool throw_paths_only;
+    std::vector<uint8_t> input;
+    std::optional<std::vector<uint8_t>> output;
+  };
+  // by FNV-1a of the input, results are checked against the full input
+  std::unordered_multimap<uint64_t, result> results;
+  size_t cached_bytes = 0;
+  static constexpr size_t max_cached_bytes = 256 << 20;
+};
 
-    range.size = result.size() - range.data;
-  }
-  return result;
+uint64_t content_hash(std::span<const uint8_t> data) {
+  uint64_t hash = 0xcbf2'9ce4'8422'2325;
+  for (auto b : data)
+    hash = (hash ^ b) * 0x100'0000'01b3;
+  return hash;
 }
 
-auto to_entry(std::unordered_map<unwind_ref, unwind_range> const &mapping,
-              uint32_t data_offset) {
+// Writes data, or the unchanged input if there was nothing to do and the
+// output is somewhere else
+void emit(job const &j, std::optional<std::vector<uint8_t>> &data,
+          std::vector<uint8_t> &input) {
+  if (data)
+    write_file(*data, j.output);
+  else if (j.output != j.input)
+    write_file(input, j.output);
+}
+
+void run(job const &j, warm_state *warm) {
+  auto n = read_file(j.input);
+  // a profile can change without the input changing, so those skip the cache
+  if (!warm || !j.profile.empty()) {
+    auto data = generate(j, n, warm ? &warm->cies : nullptr);
+    emit(j, data, n);
+    return;
+  }
 
-  return std::views::transform([&, data_offset](frame &f) {
-    auto range = mapping.at(std::cref(f.stack));
-    if (f.stack.cfa_register != 28 && f.stack.cfa_register != 32) {
-      throw std::runtime_error("CFA_register is not r28 or r32!");
+  auto hash = content_hash(n);
+  // copied out, another job may evict it once the lock is released
+  std::optional<std::optional<std::vector<uint8_t>>> cached;
+  {
+    auto lock = std::lock_guard(warm->lock);
+    auto [first, last] = warm->results.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+      auto &r = it->second;
+      if (r.object_mode == j.object_mode &&
+          r.throw_paths_only == j.throw_paths_only &&
+          std::ranges::equal(r.input, n)) {
+        cached = r.output;
+        break;
+      }
     }
-    return fae::table_entry{.pc_begin = cast16(f.begin),
-                            .pc_end = cast16(f.begin + f.range),
-                            .data = cast16(range.data + data_offset),
-                            .frame_reg = cast8(f.stack.cfa_register),
-                            .length = range.size,
-                            .lsda = cast16(f.lsda)};
-  });
+  }
+  if (cached) {
+    emit(j, *cached, n);
+    return;
+  }
+  auto data = generate(j, n, &warm->cies);
+  emit(j, data, n);
+
+  auto lock = std::lock_guard(warm->lock);
+  auto size = n.size() + (data ? data->size() : 0);
+  if (warm->cached_bytes + size > warm_state::max_cached_bytes) {
+    warm->results.clear();
+    warm->cached_bytes = 0;
+  }
+  warm->cached_bytes += size;
+  warm->results.insert(
+      {hash,
+       {j.object_mode, j.throw_paths_only, std::move(n), std::move(data)}});
 }
 
-constexpr auto shtab = "\0.shstrtab\0.fae_data\0\0"sv;
-elf::file create_obj(elf::u32 flags) {
-  elf::file r{.format = elf::e32,
-              .endian = elf::little,
-              .abi = elf::os_abi::sys_v,
-              .abi_version = 0,
-              .type = elf::rel,
-              .machine = elf::machine_type::avr,
-              .entry_point = 0,
-              .flags = flags,
-              .sh_str_index = 1,
-              .program_headers = {},
-              .name_map = {{"", 0},
-                           {".shstrtab", 1},
-                           {".fae_data", shtab.find(".fae_data")}}};
-  r.sections.reserve(3);
-  r.sections.push_back(elf::section{.name = ".shstrtab",
-                                    .type = elf::sh::str_tab,
-                                    .flags = elf::sh::strings,
-                                    .file_offset = r.header_size(),
-                                    .data = {shtab.begin(), shtab.end()}});
-  return r;
+// Requests are "link\t<input>\t<output>[\t<profile>]" or
+// "object\t<input>\t<output>" with absolute paths, replies "ok" or
+// "error: <message>". A link with --throw-paths-only is "link,throw-paths".
+std::string encode_job(job const &j) {
+  auto mode = j.object_mode        ? "object"
+              : j.throw_paths_only ? "link,throw-paths"
+                                   : "link";
+  auto request = fmt::format("{}\t{}\t{}", mode,
+                             std::filesystem::absolute(j.input).string(),
+                             std::filesystem::absolute(j.output).string());
+  if (!j.profile.empty())
+    request += fmt::format("\t{}",
+                           std::filesystem::absolute(j.profile).string());
+  return request;
 }
 
-elf::section create_fae_section(uint32_t addr, uint32_t offset,
-                                std::span<frame> frames, auto &unwind_data,
-                                auto &offset_mapping, uint32_t file_offset) {
-  auto entries = frames | to_entry(offset_mapping, offset);
-  std::vector<uint8_t> data;
-  data.reserve(sizeof(fae::header) + entries.size() * sizeof(fae::table_entry) +
-               unwind_data.size() * sizeof(unwind_data.front()));
-  auto writer = write_vector(data);
-  writer.write(
-      fae::header{.length = cast16(entries.size() * sizeof(fae::table_entry))});
-  writer.write(entries);
-  writer.write(unwind_data);
-  return {.name = ".fae_data",
-          .type = elf::sh::prog_bit,
-          .flags = elf::sh::alloc,
-          .address = addr,
-          .file_offset = file_offset,
-          .data = std::move(data),
-          .alignment = 2};
+std::optional<job> decode_job(std::string_view line) {
+  auto mode = line.substr(0, line.find('\t'));
+  line.remove_prefix(std::min(line.size(), mode.size() + 1));
+  auto input = line.substr(0, line.find('\t'));
+  line.remove_prefix(std::min(line.size(), input.size() + 1));
+  auto output = line.substr(0, line.find('\t'));
+  line.remove_prefix(std::min(line.size(), output.size() + 1));
+  auto throw_paths_only = mode == "link,throw-paths";
+  if (throw_paths_only)
+    mode = "link";
+  if ((mode != "link" && mode != "object") || input.empty() ||
+      output.empty() || (mode == "object" && !line.empty()))
+    return std::nullopt;
+  return job{.input = std::string(input),
+             .output = std::string(output),
+             .object_mode = mode == "object",
+             .profile = std::string(line),
+             .throw_paths_only = throw_paths_only};
 }
 
-void create_fae_obj(elf::file &obj, std::span<frame> frames) {
-  std::unordered_map<unwind_ref, unwind_range> offset_mapping;
-  offset_mapping.reserve(frames.size());
-  for (auto const &f : frames) {
-    offset_mapping.insert({std::cref(f.stack), {}});
+// A name in the temp directory nobody else uses
+std::filesystem::path temp_path() {
+  auto salt = std::random_device{}() ^
+              uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+  for (;; salt++) {
+    auto path = std::filesystem::temp_directory_path() /
+                fmt::format("faegen-{:016x}.o", salt);
+    if (!std::filesystem::exists(path))
+      return path;
   }
-  auto unwind_data = create_data(offset_mapping);
-  auto text_size = obj.get_section(".text").data.size();
-  uint32_t offset = text_size + frames.size() * sizeof(fae::table_entry) +
-                    sizeof(fae::header);
-  auto elf = create_obj(obj.flags);
-  elf.sections.push_back(
-      create_fae_section(text_size, offset, frames, unwind_data, offset_mapping,
-                         elf.header_size() + elf.get_section(1).data.size()));
-  auto data = elf::serialize(elf);
-  write_file(data, "__fae_data.o");
+}
+
+[[noreturn]] void serve_jobs(std::string_view socket) {
+  warm_state warm;
+  // concurrent jobs would interleave their reports or clobber the trace file
+  std::mutex report_lock;
+  serve::listen(socket, [&](std::string_view line) -> std::string {
+    auto j = decode_job(line);
+    if (!j)
+      return fmt::format("error: malformed request '{}'", line);
+    // the report is this job's alone, not a running total
+    instrument::reset();
+    try {
+      run(*j, &warm);
+    } catch (std::exception const &e) {
+      return fmt::format("error: {}", e.what());
+    }
+    auto lock = std::lock_guard(report_lock);
+    print_reports();
+    return "ok";
+  });
 }
 } // namespace
 
 int main(int argc, char **argv) {
-  assert(argc == 2);
-  assert(!ctre::match<R"(.+\.o)">(argv[1]));
+  job j;
+  const char *input = nullptr;
+  std::string_view serve_socket, connect_socket;
+  bool counters = false;
+  for (int i = 1; i < argc; i++) {
+    auto arg = std::string_view(argv[i]);
+    if (arg == "--object") {
+      j.object_mode = true;
+    } else if (arg == "--time-report") {
+      time_report = "-";
+    } else if (arg.starts_with("--time-report=")) {
+      time_report = arg.substr(arg.find('=') + 1);
+    } else if (arg == "--mem-report") {
+      instrument::enable_memory();
+    } else if (arg == "--counters") {
+      counters = true;
+    } else if (arg == "-o" && i + 1 < argc) {
+      j.output = argv[++i];
+    } else if (arg == "--profile" && i + 1 < argc) {
+      j.profile = argv[++i];
+    } else if (arg == "--throw-paths-only") {
+      j.throw_paths_only = true;
+    } else if (arg == "--serve" && i + 1 < argc) {
+      serve_socket = argv[++i];
+    } else if (arg == "--connect" && i + 1 < argc) {
+      connect_socket = argv[++i];
+    } else if (!arg.starts_with("--") && !input) {
+      input = argv[i];
+    } else {
+      input = nullptr;
+      break;
+    }
+  }
+  if ((!input && serve_socket.empty()) ||
+      (j.object_mode && (!j.profile.empty() || j.throw_paths_only)) ||
+      (!serve_socket.empty() && !j.output.empty())) {
+    fmt::println(stderr,
+                 "usage: faegen [options] [-o <out.o>] [--profile <pcs.txt>] "
+                 "[--throw-paths-only] <elf>\n"
+                 "       faegen [options] [-o <out.o>] --object <obj.o>\n"
+                 "       faegen [options] --serve <socket>\n"
+                 "       faegen --connect <socket> [-o <out.o>] [--object] "
+                 "<elf or obj.o>\n"
+                 "-o - writes to stdout. Without -o a link writes "
+                 "__fae_data.o and --object\n"
+                 "rewrites its input. --throw-paths-only leaves out functions "
+                 "no exception can\n"
+                 "unwind through, found by following calls in AVR code.\n"
+                 "options: --time-report[=trace.json] --counters "
+                 "--mem-report");
+    return 1;
+  }
 
-  auto n = read_file(argv[1]);
-  auto e = elf::parse_buffer(n);
+  // counters go into the time report, a table unless a trace was asked for
+  if (counters) {
+    if (time_report.empty())
+      time_report = "-";
+    instrument::enable_counters();
+  }
+  if (time_report == "-") {
+    instrument::enable(instrument::mode::table);
+  } else if (!time_report.empty()) {
+    instrument::enable(instrument::mode::trace);
+  }
 
-  auto frames = parse_object(n);
-  create_fae_obj(e, frames);
+  if (!serve_socket.empty()) {
+    try {
+      serve_jobs(serve_socket);
+    } catch (std::exception const &e) {
+      fmt::println(stderr, "faegen: {}", e.what());
+      return 1;
+    }
+  }
+
+  assert(j.object_mode || !ctre::match<R"(.+\.o)">(input));
+  j.input = input;
+  if (j.output.empty())
+    j.output = j.object_mode ? input : "__fae_data.o";
+
+  if (!connect_socket.empty()) {
+    // the daemon can't write to our stdout, so it writes a file for us
+    auto remote = j;
+    if (j.output == "-")
+      remote.output = temp_path().string();
+    auto remove = sg::make_scope_guard([&]() {
+      if (remote.output != j.output)
+        std::filesystem::remove(remote.output);
+    });
+    // without a daemon the job just runs here
+    if (auto reply = serve::request(connect_socket, encode_job(remote))) {
+      if (*reply != "ok") {
+        fmt::println(stderr, "faegen: {}",
+                     reply->empty() ? "no reply" : *reply);
+        return 1;
+      }
+      try {
+        if (remote.output != j.output) {
+          auto data = read_file(remote.output);
+          write_file(data, j.output);
+        }
+      } catch (std::exception const &e) {
+        fmt::println(stderr, "faegen: {}", e.what());
+        return 1;
+      }
+      return 0;
+    }
+  }
+
+  try {
+    run(j, nullptr);
+  } catch (std::exception const &e) {
+    fmt::println(stderr, "faegen: {}", e.what());
+    return 1;
+  }
+  print_reports();
 }
@@ -1,58 +1,189 @@
 #include "elf/elf.hpp"
 #include "external/ctre/ctre.hpp"
 #include "fae.hpp"
+#include "fae_table.hpp"
+#include "instrument.hpp"
 #include "io.hpp"
 #include <cassert>
 #include <fmt/ranges.h>
 #include <iterator>
 #include <stdexcept>
 #include <algorithm>
+#include <charconv>
+#include <limits>
+#include <string>
+#include <string_view>
 
 namespace {
 using namespace std::string_view_literals;
-std::tuple<std::vector<fae::table_entry>, std::vector<fae::frame_inst>,
-           uint32_t>
-read_fae(elf::file &o) {
-  std::vector<fae::table_entry> table;
-  std::vector<fae::frame_inst> data;
+// Answers PC queries against a table the way the unwinder would: hot entries
+// are scanned first, the rest is sorted by pc_begin once and binary searched,
+// then the trivial ranges are. Each entry's answer is formatted the first time
+// it is hit, so a query is a search plus a copy.
+template <typename Target> class pc_index {
+  using entry = fae::table_entry_for<Target>;
+  using range = fae::pc_range_for<Target>;
 
-  auto scn = o.get_section(".fae_data");
-  uint8_t const *ptr = scn.data.data();
-  auto header = reinterpret_cast<fae::header const *>(ptr);
-  if (header->header != "avrc++0"sv) {
-    throw std::runtime_error(".fae_data header does not match!");
+public:
+  pc_index(std::span<const entry> table,
+           std::span<const fae::frame_inst> data, uint32_t offset,
+           uint16_t hot = 0, std::span<const range> trivial = {})
+      : table(table), data(data), offset(offset), hot(hot), trivial(trivial),
+        answers(table.size()) {
+    by_begin.reserve(table.size() - hot);
+    for (uint32_t i = hot; i < table.size(); i++) {
+      by_begin.push_back({table[i].pc_begin, i});
+    }
+    std::ranges::sort(by_begin);
   }
-  ptr += sizeof(fae::header);
-  table.reserve(header->length / sizeof(fae::table_entry));
-  std::ranges::copy(std::span(reinterpret_cast<const fae::table_entry *>(ptr),
-                              header->length / sizeof(fae::table_entry)),
-                    std::back_inserter(table));
 
-  ptr += header->length;
-  auto data_len = (scn.data.size() - header->length - sizeof(fae::header)) /
-                  sizeof(fae::frame_inst);
-  data.reserve(data_len);
-  std::ranges::copy(std::span(reinterpret_cast<const fae::frame_inst *>(ptr),
-                              reinterpret_cast<const fae::frame_inst *>(
-                                  scn.data.end().base())),
-                    std::back_inserter(data));
+  std::string_view lookup(uint64_t pc) {
+    for (uint32_t i = 0; i < hot; i++) {
+      if (pc >= table[i].pc_begin && pc < table[i].pc_end)
+        return answer(i);
+    }
+    auto it = std::ranges::upper_bound(
+        by_begin, std::pair(pc, std::numeric_limits<uint32_t>::max()),
+        [](auto const &a, auto const &b) { return a.first < b.first; });
+    if (it != by_begin.begin()) {
+      auto i = std::prev(it)->second;
+      if (pc < table[i].pc_end)
+        return answer(i);
+    }
+    return lookup_trivial(pc);
+  }
 
-  uint32_t offset = scn.address + header->length + sizeof(fae::header);
-  fmt::println("offset: {:#0x}", offset);
+private:
+  std::string_view lookup_trivial(uint64_t pc) {
+    auto it = std::ranges::upper_bound(trivial, pc, {}, [](range const &r) {
+      return uint64_t(r.begin);
+    });
+    if (it == trivial.begin() || pc >= std::prev(it)->end)
+      return "not found";
+    auto &r = *std::prev(it);
+    last_trivial = fmt::format("[{:#0x}, {:#0x}], return address only",
+                               r.begin, r.end);
+    return last_trivial;
+  }
 
-  return {std::move(table), std::move(data), offset};
-}
-} // namespace
+  std::string_view answer(uint32_t i) {
+    if (answers[i].empty())
+      answers[i] = format_entry(table[i]);
+    return answers[i];
+  }
 
-int main(int argc, char **argv) {
-  assert(argc == 2);
-  assert(ctre::match<R"(.+(:?\.o|\.elf))">(argv[1]));
+  std::string format_entry(entry const &e) const {
+    auto result =
+        fmt::format("[{:#0x}, {:#0x}], stack in r{}, lsda: {:#0x}, frame inst:",
+                    e.pc_begin, e.pc_end, e.frame_reg, e.lsda);
+    if (e.length == 0)
+      result += " none";
+    fae::for_each_inst(data.subspan(e.data - offset, e.length),
+                       [&](auto inst) {
+                         result += ' ';
+                         result += fae::describe<Target>(inst);
+                         result += ';';
+                       });
+    if (result.back() == ';')
+      result.pop_back();
+    return result;
+  }
+
+  std::span<const entry> table;
+  std::span<const fae::frame_inst> data;
+  uint32_t offset;
+  uint16_t hot;
+  std::span<const range> trivial;
+  std::vector<std::pair<uint64_t, uint32_t>> by_begin;
+  std::vector<std::string> answers;
+  std::string last_trivial;
+};
+
+// Reads whitespace or comma separated PCs, 0x-prefixed hex or decimal, and
+// writes one line per PC. Output goes through a single buffer that is
+// flushed in large blocks.
+template <typename Target>
+void query(pc_index<Target> &index, std::FILE *in) {
+  constexpr size_t block = 1 << 16;
+  fmt::memory_buffer out;
+  std::vector<char> buf(block);
+  std::string carry;
+
+  auto answer = [&](std::string_view token) {
+    uint64_t pc{};
+    auto digits = token;
+    int base = 10;
+    if (digits.starts_with("0x") || digits.starts_with("0X")) {
+      digits.remove_prefix(2);
+      base = 16;
+    }
+    auto [end, ec] =
+        std::from_chars(digits.data(), digits.data() + digits.size(), pc, base);
+    if (ec != std::errc{} || end != digits.data() + digits.size() ||
+        digits.empty()) {
+      fmt::format_to(std::back_inserter(out), "{}: invalid\n", token);
+    } else {
+      fmt::format_to(std::back_inserter(out), "{:#0x}: {}\n", pc,
+                     index.lookup(pc));
+    }
+    if (out.size() >= block) {
+      std::fwrite(out.data(), 1, out.size(), stdout);
+      out.clear();
+    }
+  };
+  auto is_sep = [](char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == ',';
+  };
+
+  while (size_t n = std::fread(buf.data(), 1, buf.size(), in)) {
+    auto chunk = std::string_view(buf.data(), n);
+    size_t pos = 0;
+    while (pos < chunk.size()) {
+      auto sep = std::ranges::find_if(chunk.substr(pos), is_sep);
+      auto end = size_t(sep - chunk.begin());
+      if (sep == chunk.end()) {
+        // token may continue in the next block
+        carry.append(chunk.substr(pos));
+        break;
+      }
+      if (!carry.empty()) {
+        carry.append(chunk.substr(pos, end - pos));
+        answer(carry);
+        carry.clear();
+      } else if (end != pos) {
+        answer(chunk.substr(pos, end - pos));
+      }
+      pos = end + 1;
+    }
+  }
+  if (!carry.empty())
+    answer(carry);
+  std::fwrite(out.data(), 1, out.size(), stdout);
+  std::fflush(stdout);
+}
 
-  auto f = read_file(argv[1]);
-  auto elf = elf::parse_buffer(f);
+// Either answers queries or dumps the whole table
+template <typename Target>
+int print_fae(elf::file &elf, bool query_mode, const char *queries) {
+  auto [table, data, offset, hot, trivial] = fae::read_fae<Target>(elf);
+  if (query_mode) {
+    auto index = pc_index<Target>(table, data, offset, hot, trivial);
+    auto in = queries ? std::fopen(queries, "r") : stdin;
+    if (!in) {
+      fmt::println(stderr, "could not open {}", queries);
+      return 1;
+    }
+    query(index, in);
+    if (queries)
+      std::fclose(in);
+    instrument::report_memory(stderr);
+    return 0;
+  }
 
-  auto [table, data, offset] = read_fae(elf);
+  fmt::println("offset: {:#0x}", offset);
   fmt::println("{} entries", table.size());
+  if (hot != 0)
+    fmt::println("{} hot entries first", hot);
   int i = 0;
   for (auto const &frame : table) {
     fmt::println("{}: [{:#0x}, {:#0x}], stack in r{}, lsda: {:#0x}", i++,
@@ -60,9 +191,58 @@ int main(int argc, char **argv) {
     if (frame.length != 0) {
       fmt::println("frame inst [{:#0x}]:", frame.data);
       auto n = std::span(data);
-      for (auto inst : n.subspan(frame.data - offset, frame.length)) {
-        fmt::println("  {}", fae::format_as(inst));
-      }
+      fae::for_each_inst(n.subspan(frame.data - offset, frame.length),
+                         [](auto inst) {
+                           fmt::println("  {}", fae::describe<Target>(inst));
+                         });
     }
   }
-}
\ No newline at end of file
+  if (!trivial.empty())
+    fmt::println("{} ranges without an entry, return address only:",
+                 trivial.size());
+  for (auto const &r : trivial)
+    fmt::println("  [{:#0x}, {:#0x}]", r.begin, r.end);
+  instrument::report_memory(stderr);
+  return 0;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  const char *input = nullptr;
+  const char *queries = nullptr;
+  bool query_mode = false;
+  for (int i = 1; i < argc; i++) {
+    auto arg = std::string_view(argv[i]);
+    if (arg == "--query") {
+      query_mode = true;
+    } else if (arg.starts_with("--query=")) {
+      query_mode = true;
+      queries = argv[i] + arg.find('=') + 1;
+    } else if (arg == "--mem-report") {
+      instrument::enable_memory();
+    } else if (!arg.starts_with("--") && !input) {
+      input = argv[i];
+    } else {
+      input = nullptr;
+      break;
+    }
+  }
+  if (!input) {
+    fmt::println(stderr,
+                 "usage: readfae [--query[=pcs.txt]] [--mem-report] <elf>");
+    return 1;
+  }
+  assert(ctre::match<R"(.+(:?\.o|\.elf))">(input));
+
+  try {
+    auto f = read_file(input);
+    auto elf = elf::parse_buffer(f);
+
+    return fae::dispatch_target(elf.machine, [&](auto t) {
+      return print_fae<decltype(t)>(elf, query_mode, queries);
+    });
+  } catch (std::exception const &e) {
+    fmt::println(stderr, "readfae: {}", e.what());
+    return 1;
+  }
+}
@@ -1,14 +1,18 @@
 #include "binary_parsing.hpp"
+#include "consume.hpp"
 #include "fae.hpp"
+#include "instrument.hpp"
 #include "parse.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstdint>
 #include <fmt/core.h>
-#include <fmt/ranges.h>
+#include <limits>
 #include <stdexcept>
-#include <type_traits>
+#include <vector>
 
 namespace {
-constexpr auto data_alignment = -1;
 enum {
   DW_CFA_advance_loc = 0x40,
   DW_CFA_offset = 0x80,
@@ -48,97 +52,266 @@ enum {
   DW_CFA_high_user = 0x3f
 };
 
-void parse(callstack *out, Reader &r,
-           std::vector<std::unordered_map<uint32_t, int64_t>> &stack) {
-  uint8_t inst = r.consume<uint8_t>();
-  auto operand = [&](auto fake_arg) {
-    decltype(fake_arg) offset{};
-    if constexpr (std::is_signed_v<decltype(fake_arg)>) {
-      offset = r.consume_sleb();
-    } else {
-      offset = r.consume_uleb();
-    }
-    return offset;
-  };
+// Rows saved by DW_CFA_remember_state. Compilers rarely nest these more than
+// once or twice, so a small inline array is plenty. Every FDE gets one, so
+// the rows are left uninitialized until pushed.
+struct row_stack {
+  constexpr static size_t max_depth = 4;
+  std::array<cfa_row, max_depth> rows;
+  size_t depth = 0;
 
-  switch (inst & 0b11000000) {
-  case DW_CFA_advance_loc:
-    return;
-  case DW_CFA_offset: {
-    uint8_t reg = inst & 0b00111111;
-    auto offset = operand(uint64_t{});
-
-    // this is jank, but reg 36 is presumably either SP or a fictional return
-    // reg for some reason
-    // AVR only
-    if (!fae::is_valid_reg(reg) && reg != 36) {
-      throw std::out_of_range(
-          fmt::format("r{} is a call-clobbered register", reg));
-    }
-    out->register_offsets[reg] = offset * data_alignment;
-    return;
+  row_stack() noexcept {}
+
+  void push(cfa_row const &r) {
+    if (depth == max_depth)
+      throw unsupported_cfi(fmt::format(
+          "DW_CFA_remember_state nested deeper than {}", max_depth));
+    rows[depth++] = r;
   }
-  case DW_CFA_restore:
-    throw std::runtime_error("I am not implementing restore.");
-  case 0:
-    break;
+  cfa_row const &pop() {
+    if (depth == 0)
+      throw unsupported_cfi("DW_CFA_restore_state without remember_state");
+    return rows[--depth];
   }
+};
 
-  switch (inst) {
-  case DW_CFA_advance_loc1:
-  case DW_CFA_advance_loc2:
-  case DW_CFA_advance_loc4:
-  case DW_CFA_set_loc:
-    return;
+struct cfi_state {
+  cfa_row row;
+  cfa_row const *initial;
+  row_stack stack{};
+  cfi_params params;
+};
 
-  case DW_CFA_def_cfa_register: {
-    out->cfa_register = operand(uint64_t{});
-    return;
-  }
+// cfa_offset is stored negated, i.e. as the offset from the CFA to SP
+constexpr auto cfa_sign = -1;
 
-  case DW_CFA_def_cfa_offset: {
-    out->cfa_offset = operand(uint64_t{}) * data_alignment;
+// Registers the target's unwinder can't restore make the FDE useless. The
+// return column is let through, where the return address lives is up to
+// the target.
+void check_reg(cfi_params const &p, uint64_t reg) {
+  if (reg == p.return_column)
     return;
+  if (reg >= cfa_row::max_reg || !(p.savable & uint64_t(1) << reg)) {
+    throw std::out_of_range(
+        fmt::format("r{} is a call-clobbered register", reg));
   }
+}
 
-  case DW_CFA_def_cfa: {
-    auto reg = operand(uint64_t{});
-    out->cfa_offset = operand(uint64_t{}) * data_alignment;
-    out->cfa_register = reg;
-    return;
-  }
+// value * factor, as the 32 bits a row keeps offsets in
+int32_t row_offset(int64_t value, int64_t factor) {
+  auto fits = [](int64_t v) {
+    return v >= std::numeric_limits<int32_t>::min() &&
+           v <= std::numeric_limits<int32_t>::max();
+  };
+  // with both factors in 32 bits the product can't overflow
+  if (!fits(value) || !fits(factor) || !fits(value * factor))
+    throw unsupported_cfi(
+        fmt::format("offset {} * {} doesn't fit 32 bits", value, factor));
+  return int32_t(value * factor);
+}
 
-  case DW_CFA_remember_state: {
-    stack.push_back(out->register_offsets);
-    return;
+void set_offset(cfi_state &s, uint64_t reg, int64_t factored) {
+  check_reg(s.params, reg);
+  s.row.set_offset(reg, row_offset(factored, s.params.data_align));
+}
+
+void restore(cfi_state &s, uint64_t reg) {
+  if (reg >= cfa_row::max_reg)
+    throw std::out_of_range(fmt::format("r{} is out of range", reg));
+  auto bit = uint64_t(1) << reg;
+  if (s.initial->saved & bit) {
+    s.row.set_offset(reg, s.initial->offsets[reg]);
+  } else {
+    s.row.saved &= ~bit;
   }
+}
 
-  case DW_CFA_restore_state: {
-    out->register_offsets = stack.back();
-    stack.pop_back();
-    return;
+void forget(cfi_state &s, uint64_t reg) {
+  if (reg < cfa_row::max_reg)
+    s.row.saved &= ~(uint64_t(1) << reg);
+}
+
+void skip_block(Cursor &r) { r.increment(r.consume_uleb()); }
+
+// One handler per opcode byte. Handlers decode their own operands, so the
+// table also doubles as the operand-size table for every opcode we accept.
+using handler = void (*)(cfi_state &, Cursor &, uint8_t inst);
+
+void op_invalid(cfi_state &, Cursor &, uint8_t inst) {
+  throw unsupported_cfi(fmt::format("unexpected DW_CFA value: {:#04x}", inst));
+}
+void op_nop(cfi_state &, Cursor &, uint8_t) {}
+void op_advance_loc(cfi_state &, Cursor &, uint8_t) {}
+void op_offset(cfi_state &s, Cursor &r, uint8_t inst) {
+  set_offset(s, inst & 0b0011'1111, r.consume_uleb());
+}
+void op_restore(cfi_state &s, Cursor &, uint8_t inst) {
+  restore(s, inst & 0b0011'1111);
+}
+void op_set_loc(cfi_state &s, Cursor &r, uint8_t) {
+  consume_ptr(r, s.params.ptr_encoding,
+              {.pc = 0, .text = 0, .data = 0, .func = 0});
+}
+template <typename Delta> void op_advance_loc_n(cfi_state &, Cursor &r, uint8_t) {
+  r.consume<Delta>();
+}
+void op_offset_extended(cfi_state &s, Cursor &r, uint8_t) {
+  auto reg = r.consume_uleb();
+  set_offset(s, reg, r.consume_uleb());
+}
+void op_offset_extended_sf(cfi_state &s, Cursor &r, uint8_t) {
+  auto reg = r.consume_uleb();
+  set_offset(s, reg, r.consume_sleb());
+}
+void op_negative_offset_extended(cfi_state &s, Cursor &r, uint8_t) {
+  auto reg = r.consume_uleb();
+  set_offset(s, reg, -int64_t(r.consume_uleb()));
+}
+void op_restore_extended(cfi_state &s, Cursor &r, uint8_t) {
+  restore(s, r.consume_uleb());
+}
+// undefined and same_value both mean there is nothing to pop
+void op_forget(cfi_state &s, Cursor &r, uint8_t) { forget(s, r.consume_uleb()); }
+void op_register(cfi_state &, Cursor &r, uint8_t) {
+  auto reg = r.consume_uleb();
+  auto other = r.consume_uleb();
+  throw unsupported_cfi(
+      fmt::format("r{} is saved in r{}, which can't be encoded", reg, other));
+}
+void op_remember_state(cfi_state &s, Cursor &, uint8_t) { s.stack.push(s.row); }
+void op_restore_state(cfi_state &s, Cursor &, uint8_t) { s.row = s.stack.pop(); }
+void op_def_cfa(cfi_state &s, Cursor &r, uint8_t) {
+  s.row.cfa_register = r.consume_uleb();
+  s.row.cfa_offset = row_offset(r.consume_uleb(), cfa_sign);
+}
+void op_def_cfa_sf(cfi_state &s, Cursor &r, uint8_t) {
+  s.row.cfa_register = r.consume_uleb();
+  s.row.cfa_offset =
+      row_offset(r.consume_sleb(), s.params.data_align * cfa_sign);
+}
+void op_def_cfa_register(cfi_state &s, Cursor &r, uint8_t) {
+  s.row.cfa_register = r.consume_uleb();
+}
+void op_def_cfa_offset(cfi_state &s, Cursor &r, uint8_t) {
+  s.row.cfa_offset = row_offset(r.consume_uleb(), cfa_sign);
+}
+void op_def_cfa_offset_sf(cfi_state &s, Cursor &r, uint8_t) {
+  s.row.cfa_offset =
+      row_offset(r.consume_sleb(), s.params.data_align * cfa_sign);
+}
+void op_def_cfa_expression(cfi_state &, Cursor &r, uint8_t) {
+  skip_block(r);
+  throw unsupported_cfi("DW_CFA_def_cfa_expression can't be encoded");
+}
+void op_expression(cfi_state &, Cursor &r, uint8_t inst) {
+  auto reg = r.consume_uleb();
+  skip_block(r);
+  throw unsupported_cfi(
+      fmt::format("r{} has an expression rule ({:#04x})", reg, inst));
+}
+void op_val_offset(cfi_state &, Cursor &r, uint8_t inst) {
+  auto reg = r.consume_uleb();
+  if (inst == DW_CFA_val_offset_sf)
+    r.consume_sleb();
+  else
+    r.consume_uleb();
+  throw unsupported_cfi(fmt::format("r{} has a val_offset rule", reg));
+}
+void op_window_save(cfi_state &, Cursor &, uint8_t) {
+  throw unsupported_cfi("DW_CFA_GNU_window_save can't be encoded");
+}
+void op_args_size(cfi_state &, Cursor &r, uint8_t) { r.consume_uleb(); }
+
+constexpr auto handlers = [] {
+  std::array<handler, 256> t;
+  t.fill(op_invalid);
+  for (int i = 0; i < 64; i++) {
+    t[DW_CFA_advance_loc | i] = op_advance_loc;
+    t[DW_CFA_offset | i] = op_offset;
+    t[DW_CFA_restore | i] = op_restore;
   }
+  t[DW_CFA_nop] = op_nop;
+  t[DW_CFA_set_loc] = op_set_loc;
+  t[DW_CFA_advance_loc1] = op_advance_loc_n<uint8_t>;
+  t[DW_CFA_advance_loc2] = op_advance_loc_n<uint16_t>;
+  t[DW_CFA_advance_loc4] = op_advance_loc_n<uint32_t>;
+  t[DW_CFA_offset_extended] = op_offset_extended;
+  t[DW_CFA_restore_extended] = op_restore_extended;
+  t[DW_CFA_undefined] = op_forget;
+  t[DW_CFA_same_value] = op_forget;
+  t[DW_CFA_register] = op_register;
+  t[DW_CFA_remember_state] = op_remember_state;
+  t[DW_CFA_restore_state] = op_restore_state;
+  t[DW_CFA_def_cfa] = op_def_cfa;
+  t[DW_CFA_def_cfa_register] = op_def_cfa_register;
+  t[DW_CFA_def_cfa_offset] = op_def_cfa_offset;
+  t[DW_CFA_def_cfa_expression] = op_def_cfa_expression;
+  t[DW_CFA_expression] = op_expression;
+  t[DW_CFA_offset_extended_sf] = op_offset_extended_sf;
+  t[DW_CFA_def_cfa_sf] = op_def_cfa_sf;
+  t[DW_CFA_def_cfa_offset_sf] = op_def_cfa_offset_sf;
+  t[DW_CFA_val_offset] = op_val_offset;
+  t[DW_CFA_val_offset_sf] = op_val_offset;
+  t[DW_CFA_val_expression] = op_expression;
+  t[DW_CFA_MIPS_advance_loc8] = op_advance_loc_n<uint64_t>;
+  t[DW_CFA_GNU_window_save] = op_window_save;
+  t[DW_CFA_GNU_args_size] = op_args_size;
+  t[DW_CFA_GNU_negative_offset_extended] = op_negative_offset_extended;
+  return t;
+}();
 
-  case DW_CFA_nop:
-    return;
-  default:
-    throw std::runtime_error(
-        fmt::format("unexpected DW_CFA value: {:#04x}", inst));
+uint64_t run(cfi_state &s, validated_region cfi) {
+  if (!hardened_build && !cfi.has_slack()) {
+    // at the end of the section, or a bare span: give it a copy with room
+    // behind it, that's rare and cheaper than checking every access
+    auto bytes = cfi.bytes();
+    std::vector<uint8_t> padded(bytes.size() + validated_region::slack);
+    std::ranges::copy(bytes, padded.begin());
+    auto r = Reader(padded).subspan(bytes.size());
+    return run(s, validated_region(r));
   }
+  uint64_t insts = 0;
+  auto r = cfi.cursor();
+  while (!r.empty()) {
+    uint8_t inst = r.consume<uint8_t>();
+    handlers[inst](s, r, inst);
+    insts++;
+  }
+  if (r.overran())
+    throw std::out_of_range("CFA instruction runs past its record");
+  return insts;
 }
 } // namespace
 
-callstack parse_cfi(std::span<const uint8_t> cfi_initial,
-                    std::span<const uint8_t> fde_cfi) {
-  callstack result;
-  std::vector<std::unordered_map<uint32_t, int64_t>> state_stack;
-  auto data = Reader(cfi_initial);
-  while (!data.empty()) {
-    parse(&result, data, state_stack);
-  }
-  auto ptr = Reader(fde_cfi);
-  while (!ptr.empty()) {
-    parse(&result, ptr, state_stack);
+cfa_row parse_initial_cfi(validated_region cie_cfi, cfi_params params) {
+  auto timer = instrument::scope(instrument::phase::parse_cfi);
+  // restore inside a CIE has nothing to go back to but the empty row
+  auto empty = cfa_row{};
+  auto s = cfi_state{.row = empty, .initial = &empty, .params = params};
+  timer.items(run(s, cie_cfi));
+  return s.row;
+}
+
+callstack parse_cfi(cfa_row const &initial, validated_region fde_cfi,
+                    cfi_params params, std::pmr::memory_resource *mr) {
+  auto timer = instrument::scope(instrument::phase::parse_cfi);
+  auto s = cfi_state{.row = initial, .initial = &initial, .params = params};
+  timer.items(run(s, fde_cfi));
+
+  callstack result{.register_offsets =
+                       std::pmr::unordered_map<uint32_t, int64_t>(mr),
+                   .cfa_offset = s.row.cfa_offset,
+                   .cfa_register = s.row.cfa_register};
+  for (auto saved = s.row.saved; saved != 0; saved &= saved - 1) {
+    auto reg = std::countr_zero(saved);
+    result.register_offsets[reg] = s.row.offsets[reg];
   }
   return result;
 }
+
+callstack parse_cfi(std::span<const uint8_t> cfi_initial,
+                    std::span<const uint8_t> fde_cfi,
+                    std::pmr::memory_resource *mr) {
+  auto initial = parse_initial_cfi(validated_region(cfi_initial), {});
+  return parse_cfi(initial, validated_region(fde_cfi), {}, mr);
+}
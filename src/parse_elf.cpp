@@ -2,6 +2,8 @@
 #include "elf/elf.hpp"
 #include "elf/parse.hpp"
 #include "elf/types.hpp"
+#include "elf/view.hpp"
+#include "instrument.hpp"
 #include <cast.hpp>
 
 #include <cstddef>
@@ -14,42 +16,66 @@ namespace elfp = elf::parse;
 
 namespace {
 
-
-template <std::integral Int>
+template <typename L>
 elf::file read_sections(std::span<uint8_t> buffer, elfp::header head,
-                        elfp::header_body<Int> &body, elfp::header_tail &tail,
-                        std::span<elfp::section_header<Int>> headers) {
-  std::unordered_map<std::string_view, uint32_t> name_map;
-  auto &sh_str_tab = headers[tail.section_str_index];
-  auto read_header = std::views::transform([&](elfp::section_header<Int> sh) {
-    auto data_start = buffer.data() + sh.offset;
-    return elf::section{
-        .name = reinterpret_cast<const char *>(sh_str_tab.offset +
-                                               sh.name_offset + buffer.data()),
+                        typename L::body body, elfp::header_tail tail,
+                        std::pmr::memory_resource *mr) {
+  using section_header = L::section_header;
+  if (body.section_offset > buffer.size())
+    throw std::out_of_range("section headers are outside of the file");
+  auto table = std::span<const uint8_t>(buffer).subspan(body.section_offset);
+  auto sh_str_tab =
+      L::template load<section_header>(table, tail.section_str_index);
+  if (sh_str_tab.offset + sh_str_tab.size > buffer.size() ||
+      sh_str_tab.size == 0 || buffer[sh_str_tab.offset + sh_str_tab.size - 1])
+    throw std::out_of_range("section name table is outside of the file");
+  auto *str_tab =
+      reinterpret_cast<const char *>(sh_str_tab.offset + buffer.data());
+
+  std::pmr::vector<elf::section> sections(mr);
+  std::pmr::unordered_map<std::string_view, uint32_t> name_map(mr);
+  sections.reserve(tail.sh_num);
+  name_map.reserve(tail.sh_num);
+  for (size_t i = 0; i < tail.sh_num; i++) {
+    auto sh = L::template load<section_header>(table, i);
+    if (sh.name_offset >= sh_str_tab.size)
+      throw std::out_of_range(
+          fmt::format("name of section {} is outside of its table", i));
+    // SHT_NOBITS takes no room in the file, whatever its offset and size
+    bool nobits = sh.type == elf::sh::nobit;
+    if (!nobits &&
+        (sh.offset > buffer.size() || sh.size > buffer.size() - sh.offset))
+      throw std::out_of_range(
+          fmt::format("section {} is outside of the file", i));
+    auto data_start = nobits ? buffer.data() : buffer.data() + sh.offset;
+    auto data_end = nobits ? data_start : data_start + sh.size;
+    instrument::note_buffer("section data", data_end - data_start);
+    sections.push_back(elf::section{
+        .name = std::pmr::string(str_tab + sh.name_offset, mr),
         .type = sh.type,
         .flags = static_cast<elf::sh::flags64>(static_cast<elf::u64>(sh.flags)),
         .address = sh.address,
         .file_offset = sh.offset,
-        .data = std::vector<uint8_t>(data_start, data_start + sh.size),
+        .data = std::pmr::vector<uint8_t>(data_start, data_end, mr),
+        .nobits_size = nobits ? elf::u64(sh.size) : 0,
         .link = sh.link,
         .info = sh.info,
         .alignment = sh.alignment,
-        .entry_size = sh.entry_size};
-  });
-
-  std::vector<elf::section> sections;
-  sections.reserve(headers.size());
-  std::ranges::copy(headers | read_header, std::back_inserter(sections));
-
-  auto *str_tab = reinterpret_cast<const char *>(
-      headers[tail.section_str_index].offset + buffer.data());
-  name_map.reserve(headers.size());
-  for (auto &section : headers) {
-    name_map.insert({str_tab + section.name_offset, section.name_offset});
+        .entry_size = sh.entry_size});
+    name_map.insert({str_tab + sh.name_offset, sh.name_offset});
   }
 
-  auto program_start = reinterpret_cast<elf::program_header *>(
-      buffer.data() + body.program_offset);
+  std::pmr::vector<elf::program_header> program_headers(mr);
+  program_headers.reserve(tail.ph_num);
+  if (tail.ph_num != 0) {
+    if (body.program_offset > buffer.size())
+      throw std::out_of_range("program headers are outside of the file");
+    auto ph_table =
+        std::span<const uint8_t>(buffer).subspan(body.program_offset);
+    for (size_t i = 0; i < tail.ph_num; i++)
+      program_headers.push_back(
+          L::template load<elf::program_header>(ph_table, i));
+  }
 
   return {.format = head.format,
           .endian = head.endian,
@@ -63,127 +89,225 @@ elf::file read_sections(std::span<uint8_t> buffer, elfp::header head,
           .flags = tail.flags,
           .sh_str_index = tail.section_str_index,
           .sections = std::move(sections),
-          .program_headers =
-              std::vector(program_start, program_start + tail.ph_num),
+          .program_headers = std::move(program_headers),
           .name_map = std::move(name_map)};
 }
 
 } // namespace
 
-elf::file elf::parse_buffer(std::span<uint8_t> buffer) {
-
-  auto data = Reader(buffer);
-  auto head = data.consume<elfp::header>();
-  elfp::header_tail tail;
-
-  if (head.format == elf::e32) {
-    elfp::body32 body = data.consume<elfp::body32>();
-    tail = data.consume<elfp::header_tail>();
-    auto headers = std::span(reinterpret_cast<elfp::section_header32 *>(
-                                 buffer.data() + body.section_offset),
-                             tail.sh_num);
-    return read_sections<u32>(buffer, head, body, tail, headers);
-  } else {
-    elfp::body64 body = data.consume<elfp::body64>();
-    tail = data.consume<elfp::header_tail>();
-    auto headers = std::span(reinterpret_cast<elfp::section_header64 *>(
-                                 buffer.data() + body.section_offset),
-                             tail.sh_num);
-    return read_sections<u64>(buffer, head, body, tail, headers);
-  }
+elf::file elf::parse_buffer(std::span<uint8_t> buffer,
+                            std::pmr::memory_resource *mr) {
+  auto timer = instrument::scope(instrument::phase::parse_buffer);
+  if (buffer.size() < sizeof(elfp::header))
+    throw std::out_of_range("file is too small to be an ELF file");
+  // class and byte order are single bytes, so they read the same either way
+  auto ident = Reader(buffer).view<elfp::header>();
+  if (ident.magic != elfp::header::default_magic)
+    throw std::runtime_error("not an ELF file");
+  return view::dispatch(ident.format, ident.endian, [&](auto l) {
+    using L = decltype(l);
+    auto data = Reader(buffer);
+    auto head = L::convert(data.consume<elfp::header>());
+    auto body = L::convert(data.consume<typename L::body>());
+    auto tail = L::convert(data.consume<elfp::header_tail>());
+    timer.items(tail.sh_num);
+    return read_sections<L>(buffer, head, body, tail, mr);
+  });
 }
 
 namespace {
 
-template <template <typename> typename T> size_t sizeof_elf(bool is_64) {
-  if (is_64) {
-    return sizeof(T<elf::u64>);
-  } else {
-    return sizeof(T<elf::u32>);
-  }
-}
-
-template <std::integral Int>
-void write_sections(std::span<uint8_t> result, elf::file f,
+template <typename L>
+void write_sections(std::span<uint8_t> result, elf::file const &f,
                     size_t sh_begin_offset) {
-
-  auto *headers = reinterpret_cast<elfp::section_header<Int> *>(
-      result.data() + sh_begin_offset);
-
+  using Int = L::addr;
+  auto *headers = result.data() + sh_begin_offset;
   for (auto &sh : f.sections) {
     if (!sh.data.empty())
       std::memcpy(result.data() + sh.file_offset, sh.data.data(),
                   sh.data.size());
-    auto h = elfp::section_header<Int>{.name_offset = f.name_map.at(sh.name),
-                                       .type = sh.type,
-                                       .flags = elf::sh::convert<Int, elf::u64>(sh.flags),
-                                       .address = cast<Int>(sh.address),
-                                       .offset = cast<Int>(sh.file_offset),
-                                       .size = cast<Int>(sh.data.size()),
-                                       .link = sh.link,
-                                       .info = sh.info,
-                                       .alignment = cast<Int>(sh.alignment),
-                                       .entry_size = cast<Int>(sh.entry_size)};
-    std::memcpy(headers++, &h, sizeof(elfp::section_header<Int>));
+    L::store(headers,
+             elfp::section_header<Int>{
+                 .name_offset = f.name_map.at(sh.name),
+                 .type = sh.type,
+                 .flags = elf::sh::convert<Int, elf::u64>(sh.flags),
+                 .address = cast<Int>(sh.address),
+                 .offset = cast<Int>(sh.file_offset),
+                 .size = cast<Int>(sh.type == elf::sh::nobit
+                                       ? sh.nobits_size
+                                       : sh.data.size()),
+                 .link = sh.link,
+                 .info = sh.info,
+                 .alignment = cast<Int>(sh.alignment),
+                 .entry_size = cast<Int>(sh.entry_size)});
+    headers += sizeof(elfp::section_header<Int>);
   }
 }
-} // namespace
 
-std::vector<uint8_t> elf::serialize(file f) {
+template <typename L> std::vector<uint8_t> serialize(elf::file const &f) {
+  using Int = L::addr;
+  using section_header = L::section_header;
   std::vector<uint8_t> result;
-  namespace elfp = elf::parse;
-  size_t size = 0;
-  for (auto sh : f.sections) {
+  auto ph_size = f.program_headers.size() * sizeof(elf::program_header);
+  auto sh_size = f.sections.size() * sizeof(section_header);
+  // the program headers follow the ELF header, the section headers come
+  // last, aligned, as linkers and assemblers lay them out
+  size_t size = f.header_size() + ph_size;
+  for (auto &sh : f.sections) {
     auto new_size = sh.file_offset + sh.data.size();
     if (new_size > size) {
       size = new_size;
     }
   }
-  size_t sh_begin_offset = size;
-  auto alignment = f.format == elf_class::e32 ? alignof(u32) : alignof(u64);
-  size += alignment - (size % alignment);
-  bool is_64 = f.format == elf_class::e64;
-  auto ph_size = f.program_headers.size() * sizeof(elf::program_header);
-  auto sh_size = f.sections.size() * sizeof_elf<elfp::section_header>(is_64);
-  size += f.header_size() + sh_size + ph_size;
+  size_t sh_begin_offset =
+      (size + alignof(Int) - 1) / alignof(Int) * alignof(Int);
+  size = sh_begin_offset + sh_size;
   result.reserve(size);
   auto writer = write_vector(result);
-  writer.write(elfp::header{.magic = parse::header::default_magic,
-                            .format = f.format,
-                            .endian = f.endian,
-                            .ei_version = f.ei_version,
-                            .abi = f.abi,
-                            .abi_version = f.abi_version,
-                            .type = f.type,
-                            .machine = f.machine,
-                            .e_version = f.e_version});
-  if (f.format == elf::e32) {
-    writer.write(elfp::body32{
-        .entry_point = cast<u32>(f.entry_point),
+  writer.write(L::convert(elfp::header{.magic = elfp::header::default_magic,
+                                       .format = f.format,
+                                       .endian = f.endian,
+                                       .ei_version = f.ei_version,
+                                       .abi = f.abi,
+                                       .abi_version = f.abi_version,
+                                       .type = f.type,
+                                       .machine = f.machine,
+                                       .e_version = f.e_version}));
+  if constexpr (L::format == elf::e32) {
+    writer.write(L::convert(elfp::body32{
+        .entry_point = cast<elf::u32>(f.entry_point),
         .program_offset = f.program_headers.empty() ? 0 : f.header_size(),
-        .section_offset = cast<u32>(sh_begin_offset)});
+        .section_offset = cast<elf::u32>(sh_begin_offset)}));
   } else {
-    writer.write(elfp::body64{.entry_point = f.entry_point,
-                              .program_offset = f.header_size(),
-                              .section_offset = sh_begin_offset});
+    writer.write(L::convert(elfp::body64{.entry_point = f.entry_point,
+                                         .program_offset =
+                                             f.program_headers.empty()
+                                                 ? 0
+                                                 : f.header_size(),
+                                         .section_offset = sh_begin_offset}));
   }
-  writer.write(elfp::header_tail{
+  writer.write(L::convert(elfp::header_tail{
       .flags = f.flags,
-      .header_size = cast<u16>(f.header_size()),
-      .ph_size = cast<u16>(
+      .header_size = cast<elf::u16>(f.header_size()),
+      .ph_size = cast<elf::u16>(
           f.program_headers.empty() ? 0 : sizeof(elf::program_header)),
-      .ph_num = cast<u16>(f.program_headers.size()),
-      .sh_size = cast<u16>(sizeof_elf<elfp::section_header>(is_64)),
-      .sh_num = cast<u16>(f.sections.size()),
-      .section_str_index = f.sh_str_index});
-  writer.write(f.program_headers);
+      .ph_num = cast<elf::u16>(f.program_headers.size()),
+      .sh_size = cast<elf::u16>(sizeof(section_header)),
+      .sh_num = cast<elf::u16>(f.sections.size()),
+      .section_str_index = f.sh_str_index}));
+  for (auto &ph : f.program_headers)
+    writer.write(L::convert(ph));
   result.resize(size, 0);
 
-  if (is_64) {
-    write_sections<u64>(result, f, sh_begin_offset);
-  } else {
-    write_sections<u32>(result, f, sh_begin_offset);
+  write_sections<L>(result, f, sh_begin_offset);
+  return result;
+}
+} // namespace
+
+std::vector<uint8_t> elf::serialize(file const &f) {
+  auto timer = instrument::scope(instrument::phase::serialize);
+  auto result = view::dispatch(
+      f.format, f.endian, [&](auto l) { return ::serialize<decltype(l)>(f); });
+  timer.items(result.size());
+  instrument::note_buffer("serialize", result.size());
+  return result;
+}
+namespace {
+template <typename L>
+std::pmr::vector<elf::symbol> read_symbols(elf::file const &f,
+                                           elf::section const &symtab,
+                                           std::pmr::memory_resource *mr) {
+  using raw = L::symbol;
+  auto &strtab = f.get_section(symtab.link);
+  auto names = reinterpret_cast<const char *>(strtab.data.data());
+  std::pmr::vector<elf::symbol> result(mr);
+  result.reserve(symtab.data.size() / sizeof(raw));
+  auto r = Reader(symtab.data);
+  while (!r.empty()) {
+    auto s = L::convert(r.consume<raw>());
+    if (s.name_offset >= strtab.data.size())
+      throw std::out_of_range("symbol name is outside of its string table");
+    result.push_back({.name = names + s.name_offset,
+                      .value = s.value,
+                      .size = s.size,
+                      .info = s.info,
+                      .other = s.other,
+                      .section = s.section});
   }
+  return result;
+}
 
+template <typename L>
+std::pmr::vector<elf::relocation>
+read_relocations(elf::section const &reloc, std::pmr::memory_resource *mr) {
+  std::pmr::vector<elf::relocation> result(mr);
+  auto r = Reader(reloc.data);
+  while (!r.empty()) {
+    if (reloc.type == elf::sh::rela) {
+      auto rel = L::convert(r.consume<typename L::rela>());
+      result.push_back({.offset = rel.offset,
+                        .symbol = elfp::info_symbol(rel.info),
+                        .type = elfp::info_type(rel.info),
+                        .addend = rel.addend});
+    } else {
+      auto rel = L::convert(r.consume<typename L::rel>());
+      result.push_back({.offset = rel.offset,
+                        .symbol = elfp::info_symbol(rel.info),
+                        .type = elfp::info_type(rel.info)});
+    }
+  }
   return result;
-}
\ No newline at end of file
+}
+
+template <typename L>
+std::pmr::vector<uint8_t> write_relocations(elf::sh::type type,
+                                            std::span<const elf::relocation> rs,
+                                            std::pmr::memory_resource *mr) {
+  using Int = L::addr;
+  std::pmr::vector<uint8_t> result(mr);
+  auto writer = write_vector(result);
+  for (auto &r : rs) {
+    auto info = elfp::make_info<Int>(r.symbol, r.type);
+    if (type == elf::sh::rela) {
+      writer.write(L::convert(elfp::rela<Int>{
+          .offset = cast<Int>(r.offset),
+          .info = info,
+          .addend = cast<std::make_signed_t<Int>>(r.addend)}));
+    } else {
+      writer.write(
+          L::convert(elfp::rel<Int>{.offset = cast<Int>(r.offset), .info = info}));
+    }
+  }
+  return result;
+}
+} // namespace
+
+std::pmr::vector<elf::symbol> elf::read_symbols(file const &f,
+                                                section const &symtab,
+                                                std::pmr::memory_resource *mr) {
+  return view::dispatch(f.format, f.endian, [&](auto l) {
+    return ::read_symbols<decltype(l)>(f, symtab, mr);
+  });
+}
+
+std::pmr::vector<elf::relocation>
+elf::read_relocations(file const &f, section const &reloc,
+                      std::pmr::memory_resource *mr) {
+  if (reloc.type != sh::rel && reloc.type != sh::rela)
+    throw std::invalid_argument(
+        fmt::format("{} is not a relocation section", reloc.name));
+  return view::dispatch(f.format, f.endian, [&](auto l) {
+    return ::read_relocations<decltype(l)>(reloc, mr);
+  });
+}
+
+std::pmr::vector<uint8_t>
+elf::write_relocations(file const &f, sh::type type,
+                       std::span<const relocation> relocs,
+                       std::pmr::memory_resource *mr) {
+  if (type != sh::rel && type != sh::rela)
+    throw std::invalid_argument("not a relocation section type");
+  return view::dispatch(f.format, f.endian, [&](auto l) {
+    return ::write_relocations<decltype(l)>(type, relocs, mr);
+  });
+}
@@ -1,31 +1,45 @@
 #include "binary_parsing.hpp"
 #include "elf/elf.hpp"
+#include "instrument.hpp"
 #include "parse.hpp"
 
 #include "consume.hpp"
-#include <cassert>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <optional>
 #include <fcntl.h>
 #include <fmt/core.h>
 #include <fmt/ranges.h>
+#include <algorithm>
 #include <span>
 #include <stdexcept>
 #include <string_view>
+#include <vector>
 
 namespace {
-struct cie {
-  uint8_t lsda_encoding = DW_EH_PE_omit, personality_encoding = DW_EH_PE_omit,
-          ptr_encoding = DW_EH_PE_omit;
-  int64_t personality{}, code_align{}, data_align{}, ret_addr_reg{};
-  const uint8_t *begin_instruction{}, *end_instruction{};
-};
+cfi_params params(cie const &c) {
+  return {.code_align = c.code_align,
+          .data_align = c.data_align,
+          .ptr_encoding = c.ptr_encoding,
+          .savable = c.savable,
+          .return_column = uint32_t(c.ret_addr_reg)};
+}
+
+uint64_t savable_registers(elf::file const &e) {
+  return fae::dispatch_target(e.machine, [](auto t) {
+    return fae::target::savable_mask<decltype(t)>();
+  });
+}
 
-cie parse_cie(Reader data) {
+cie parse_cie(Reader data, uint64_t savable) {
+  auto timer = instrument::scope(instrument::phase::parse_cie);
+  timer.items(1);
   cie result{};
+  result.savable = savable;
   auto version = data.consume<uint8_t>();
-  assert(version == 1 || version == 3);
+  if (version != 1 && version != 3)
+    throw unsupported_cfi(fmt::format("CIE version {} is not 1 or 3", version));
 
   auto aug = data.consume_cstr();
   result.code_align = data.consume_uleb();
@@ -37,9 +51,10 @@ cie parse_cie(Reader data) {
   }
 
   if (aug.find('z') != std::string_view::npos) {
+    result.has_augmentation_data = true;
     uint64_t aug_len = data.consume_uleb();
-    auto aug_data = data.consume_vec<uint8_t>(aug_len);
-    auto aug_reader = Reader(aug_data);
+    auto aug_reader = data.subspan(aug_len);
+    data.increment(aug_len);
     for (auto c : aug) {
       switch (c) {
       case 'z':
@@ -49,72 +64,296 @@ cie parse_cie(Reader data) {
         break;
       case 'P': {
         result.personality_encoding = aug_reader.consume<uint8_t>();
-        result.personality =
-            consume_ptr(aug_reader, result.personality_encoding);
+        // nothing needs the routine's address, so a PC relative one is
+        // kept relative to its field
+        result.personality = consume_ptr(aug_reader,
+                                         result.personality_encoding, {.pc = 0});
       } break;
       case 'R':
         result.ptr_encoding = aug_reader.consume<uint8_t>();
         break;
       default:
-        throw std::runtime_error("I'm not handling eh");
+        throw unsupported_cfi(
+            fmt::format("unknown CIE augmentation '{}' in \"{}\"", c, aug));
       }
     }
   }
+  result.decode_begin = select_ptr_decoder(result.ptr_encoding);
+  // the length has the same format, but no base
+  result.decode_range = select_ptr_decoder(result.ptr_encoding & 0x0f);
+  if (result.lsda_encoding != DW_EH_PE_omit) {
+    // the function base is only added by the personality
+    auto lsda = result.lsda_encoding;
+    if ((lsda & 0x70) == DW_EH_PE_funcrel)
+      lsda &= ~0x70;
+    result.decode_lsda = select_ptr_decoder(lsda);
+  }
   result.begin_instruction = data.begin;
   result.end_instruction = data.end;
+  result.initial = parse_initial_cfi(validated_region(data), params(result));
   return result;
 }
 
-frame parse_fde(Reader r, cie &cie, uint64_t base_pc) {
-  frame f = {};
-  f.begin = consume_ptr(r, cie.ptr_encoding, {.pc = base_pc + r.bytes_read});
-  f.range = consume_ptr(r, cie.ptr_encoding & 0b0000'1111,
-                        {.pc = base_pc + r.bytes_read});
-  if (cie.lsda_encoding != DW_EH_PE_omit) {
-    uint64_t _ = r.consume_uleb(); // lsda_len
-    // we don't actually know the function at this point in
-    //  time function base address is added when parsing in personality f.lsda =
-    f.lsda = consume_ptr(r, cie.lsda_encoding, {.func = 0});
+// Calls f with the FDE body r as a validated_region. Like the CFA
+// instructions, a record without slack behind it is decoded from a padded
+// copy, which only lives as long as the call.
+template <typename F> decltype(auto) with_region(Reader const &r, F &&f) {
+  auto region = validated_region(r);
+  if (!hardened_build && !region.has_slack()) {
+    auto bytes = region.bytes();
+    std::vector<uint8_t> padded(bytes.size() + validated_region::slack);
+    std::ranges::copy(bytes, padded.begin());
+    return f(validated_region(Reader(padded).subspan(bytes.size())));
+  }
+  return f(region);
+}
+
+int64_t fde_begin(Reader r, cie const &cie, uint64_t base_pc) {
+  return with_region(r, [&](validated_region region) {
+    auto c = region.cursor();
+    auto begin = cie.decode_begin(c, base_pc + r.bytes_read);
+    if (c.overran())
+      throw std::out_of_range("FDE header runs past its record");
+    return begin;
+  });
+}
+
+frame parse_fde(Reader r, cie const &cie, uint64_t base_pc,
+                std::pmr::memory_resource *mr) {
+  auto timer = instrument::scope(instrument::phase::parse_fde);
+  timer.items(1);
+  return with_region(r, [&](validated_region region) {
+    auto c = region.cursor();
+    // offset within .eh_frame of the field c is at
+    auto field = [&] {
+      return r.bytes_read + uint64_t(c.begin - region.bytes().data());
+    };
+    uint64_t begin_field = field();
+    int64_t begin = cie.decode_begin(c, base_pc + begin_field);
+    int64_t range = cie.decode_range(c, 0);
+    int64_t lsda = 0;
+    uint64_t lsda_field = 0;
+    if (cie.has_augmentation_data) {
+      uint64_t aug_len = c.consume_uleb();
+      if (cie.decode_lsda) {
+        lsda_field = field();
+        auto aug = c;
+        lsda = cie.decode_lsda(aug, base_pc + lsda_field);
+        if (uint64_t(aug.begin - c.begin) > aug_len)
+          throw std::out_of_range("LSDA runs past the augmentation data");
+      }
+      // checked, so it also catches a header that overran
+      c.increment(aug_len);
+    }
+    if (c.overran())
+      throw std::out_of_range("FDE header runs past its record");
+    // built in place so the callstack keeps the arena allocator
+    return frame{.begin = begin,
+                 .range = range,
+                 .lsda = lsda,
+                 .stack = parse_cfi(cie.initial, region.rest(c), params(cie),
+                                    mr),
+                 .begin_field = begin_field,
+                 .lsda_field = lsda_field};
+  });
+}
+
+// A CIE or FDE in .eh_frame. body starts right after the CIE pointer and
+// covers the rest of the record.
+struct record {
+  uint64_t pos;
+  bool is_cie;
+  uint64_t cie_pos;
+  Reader body;
+};
+
+// Reads the record at data and advances past it. Returns nullopt at the
+// zero terminator or the end of the section.
+std::optional<record> next_record(Reader &data) {
+  if (data.empty())
+    return std::nullopt;
+  auto pos = data.bytes_read;
+  uint64_t length = data.consume<uint32_t>();
+
+  if (length == 0)
+    return std::nullopt;
+  if (length == 0xffff'ffff) {
+    length = data.consume<uint64_t>();
   }
-  f.stack =
-      parse_cfi({cie.begin_instruction, cie.end_instruction}, {r.begin, r.end});
+  int32_t cie_ptr = data.consume<int32_t>();
+  // this doesn't actually handle extended length properly, but hopefully
+  // nobody actually creates a hideously long CIE
+  auto result = record{.pos = pos,
+                       .is_cie = cie_ptr == 0,
+                       .cie_pos = data.bytes_read - cie_ptr - sizeof(cie_ptr),
+                       .body = data.subspan(length - sizeof(cie_ptr))};
+  data.increment(length - sizeof(cie_ptr));
+  return result;
+}
+
+// The ELF structures are read in either byte order, but the .eh_frame
+// decoding below still assumes the little endian targets this is written for
+void check_byte_order(elf::file const &e) {
+  if (e.endian != elf::little)
+    throw std::runtime_error(
+        fmt::format(".eh_frame of a {} endian file is not supported",
+                    e.endian));
+}
+
+} // namespace
+
+fde_index::fde_index(elf::file const &e, std::pmr::memory_resource *mr)
+    : eh_frame(&e.get_section(".eh_frame")), table(mr), cies(mr), mr(mr),
+      savable(savable_registers(e)) {
+  check_byte_order(e);
+  for (auto &sh : e.sections) {
+    if (sh.name == ".eh_frame_hdr") {
+      read_header(sh);
+      return;
+    }
+  }
+  synthesize();
+}
+
+void fde_index::read_header(elf::section const &hdr) {
+  auto r = Reader(hdr.data);
+  auto base = [&]() -> base_addr {
+    return {.pc = hdr.address + r.bytes_read, .data = hdr.address};
+  };
+  auto version = r.consume<uint8_t>();
+  if (version != 1)
+    throw std::runtime_error(
+        fmt::format(".eh_frame_hdr version {} is not supported", version));
+  auto eh_frame_ptr_enc = r.consume<uint8_t>();
+  auto fde_count_enc = r.consume<uint8_t>();
+  auto table_enc = r.consume<uint8_t>();
+  consume_ptr(r, eh_frame_ptr_enc, base());
+  if (fde_count_enc == DW_EH_PE_omit || table_enc == DW_EH_PE_omit) {
+    // no search table, only the pointer to .eh_frame
+    synthesize();
+    return;
+  }
+  auto count = consume_ptr(r, fde_count_enc, base());
+  table.reserve(count);
+  for (int64_t i = 0; i < count; i++) {
+    uint64_t pc = consume_ptr(r, table_enc, base());
+    uint64_t fde = consume_ptr(r, table_enc, base());
+    table.push_back({.pc = pc, .offset = fde - eh_frame->address});
+  }
+  // the linker sorts it, but a bad table would make lookups silently wrong
+  if (!std::ranges::is_sorted(table, {}, &entry::pc))
+    std::ranges::sort(table, {}, &entry::pc);
+}
+
+void fde_index::synthesize() {
+  auto data = Reader(eh_frame->data);
+  while (auto rec = next_record(data)) {
+    if (rec->is_cie)
+      continue;
+    auto &c = get_cie(rec->cie_pos);
+    uint64_t pc = fde_begin(rec->body, c, eh_frame->address);
+    table.push_back({.pc = pc, .offset = rec->pos});
+  }
+  std::ranges::sort(table, {}, &entry::pc);
+}
+
+cie const &fde_index::get_cie(uint64_t offset) {
+  auto it = cies.find(offset);
+  if (it != cies.end())
+    return it->second;
+  auto data = Reader(eh_frame->data);
+  data.increment(offset);
+  auto rec = next_record(data);
+  if (!rec || !rec->is_cie)
+    throw std::runtime_error(fmt::format("no CIE at {:#x}", offset));
+  return cies.insert({offset, parse_cie(rec->body, savable)}).first->second;
+}
+
+std::optional<frame> fde_index::lookup_fde(uint64_t pc) {
+  auto it = std::ranges::upper_bound(table, pc, {}, &entry::pc);
+  if (it == table.begin())
+    return std::nullopt;
+  --it;
+  auto data = Reader(eh_frame->data);
+  data.increment(it->offset);
+  auto rec = next_record(data);
+  if (!rec || rec->is_cie)
+    throw std::runtime_error(fmt::format("no FDE at {:#x}", it->offset));
+  auto f = parse_fde(rec->body, get_cie(rec->cie_pos), eh_frame->address, mr);
+  if (pc >= uint64_t(f.begin + f.range))
+    return std::nullopt;
   return f;
 }
 
-std::vector<frame> parse_eh(std::span<uint8_t> o) {
-  elf::file e = elf::parse_buffer(o);
-  std::unordered_map<uint64_t, cie> cies;
-  std::vector<frame> frames;
-  auto section = e.get_section(".eh_frame");
-  auto data = Reader(section.data);
-  while (!data.empty()) {
-    auto pos = data.bytes_read;
-    uint64_t length = data.consume<uint32_t>();
-
-    if (length == 0)
-      break;
-    if (length == 0xffff'ffff) {
-      length = data.consume<uint64_t>();
+cie cie_cache::get(std::span<const uint8_t> body, uint64_t savable) {
+  auto key = std::string(reinterpret_cast<const char *>(body.data()),
+                         body.size());
+  key.append(reinterpret_cast<const char *>(&savable), sizeof(savable));
+  auto lock = std::lock_guard(mutex);
+  auto it = cies.find(key);
+  if (it == cies.end()) {
+    auto size = key.size() + sizeof(cie);
+    if (cached_bytes + size > max_cached_bytes) {
+      cies.clear();
+      cached_bytes = 0;
     }
-    int32_t cie_ptr = data.consume<int32_t>();
+    it = cies.insert({std::move(key), parse_cie(Reader(body), savable)})
+             .first;
+    cached_bytes += size;
+  }
+  // only the decoded state is shared, the instructions are this file's
+  auto result = it->second;
+  auto skip = it->second.end_instruction - it->second.begin_instruction;
+  result.end_instruction = body.data() + body.size();
+  result.begin_instruction = result.end_instruction - skip;
+  return result;
+}
+
+tl::generator<frame> each_frame(elf::file const &e,
+                                std::pmr::memory_resource *mr,
+                                std::function<bool(int64_t)> wanted,
+                                cie_cache *cache, diagnostics warn) {
+  check_byte_order(e);
+  auto savable = savable_registers(e);
+  std::pmr::unordered_map<uint64_t, cie> cies(mr);
+  auto &section = e.get_section(".eh_frame");
+  auto data = Reader(section.data);
+  while (auto rec = next_record(data)) {
+    std::optional<frame> f;
     try {
-      // this doesn't actually handle extended length properly, but hopefully
-      // nobody actually creates a hideously long CIE
-      if (cie_ptr == 0) {
-        cies.insert({pos, parse_cie(data.subspan(length - 4))});
+      if (rec->is_cie) {
+        cies.insert({rec->pos,
+                     cache ? cache->get({rec->body.begin, rec->body.end},
+                                        savable)
+                           : parse_cie(rec->body, savable)});
       } else {
-        auto cie_off = data.bytes_read - cie_ptr - sizeof(cie_ptr);
-        frames.push_back(parse_fde(data.subspan(length - 4), cies.at(cie_off),
-                                   section.address));
+        auto it = cies.find(rec->cie_pos);
+        if (it == cies.end())
+          throw unsupported_cfi(
+              fmt::format("no usable CIE at {:#x}", rec->cie_pos));
+        auto &cie = it->second;
+        if (wanted && !wanted(fde_begin(rec->body, cie, section.address)))
+          continue;
+        f.emplace(parse_fde(rec->body, cie, section.address, mr));
       }
     } catch (std::out_of_range const &e) {
-      fmt::println(stderr, "Error while parsing cie: {}", e.what());
+      warn(fmt::format("Error while parsing cie: {}", e.what()));
+    } catch (unsupported_cfi const &e) {
+      warn(fmt::format("Skipping {} at {:#x}: {}", rec->is_cie ? "CIE" : "FDE",
+                       rec->pos, e.what()));
     }
-    data.increment(length - sizeof(cie_ptr));
+    if (f)
+      co_yield *f;
   }
-  return frames;
 }
 
-} // namespace
-
-std::vector<frame> parse_object(std::span<uint8_t> o) { return parse_eh(o); }
\ No newline at end of file
+std::pmr::vector<frame> parse_object(elf::file const &e,
+                                     std::pmr::memory_resource *mr,
+                                     std::function<bool(int64_t)> wanted,
+                                     cie_cache *cies, diagnostics warn) {
+  std::pmr::vector<frame> frames(mr);
+  for (auto &f : each_frame(e, mr, std::move(wanted), cies, std::move(warn)))
+    frames.push_back(std::move(f));
+  instrument::note_buffer("frames", frames.capacity() * sizeof(frame));
+  return frames;
+}
\ No newline at end of file
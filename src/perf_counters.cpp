@@ -0,0 +1,88 @@
+#include "perf_counters.hpp"
+
+#include <algorithm>
+#include <tuple>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace perf {
+#ifdef __linux__
+namespace {
+std::pair<uint32_t, uint64_t> config(event e) {
+  switch (e) {
+  case event::cycles:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+  case event::instructions:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+  case event::branch_misses:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES};
+  case event::cache_misses:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES};
+  case event::page_faults:
+    return {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS};
+  }
+  return {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_DUMMY};
+}
+
+int open_event(event e, int group) {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  std::tie(attr.type, attr.config) = config(e);
+  attr.read_format = PERF_FORMAT_GROUP;
+  // user space only, which is all an unprivileged process may count
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.disabled = group == -1;
+  return int(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+}
+} // namespace
+
+counters::counters() noexcept {
+  int leader = -1;
+  for (size_t i = 0; i < event_count; i++) {
+    auto e = event(i);
+    auto fd = open_event(e, leader);
+    if (fd < 0)
+      continue;
+    if (leader == -1)
+      leader = fd;
+    fds[i] = fd;
+    order[opened++] = e;
+  }
+  if (leader != -1) {
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+counters::~counters() {
+  for (auto fd : fds) {
+    if (fd >= 0)
+      close(fd);
+  }
+}
+
+values counters::read() const noexcept {
+  values result{};
+  if (opened == 0)
+    return result;
+  // PERF_FORMAT_GROUP: the number of events, then one value per event
+  std::array<uint64_t, event_count + 1> buf{};
+  auto leader = fds[size_t(order[0])];
+  if (::read(leader, buf.data(), sizeof(buf)) < ssize_t(sizeof(uint64_t)))
+    return result;
+  for (size_t i = 0; i < std::min<uint64_t>(buf[0], opened); i++)
+    result[size_t(order[i])] = buf[i + 1];
+  return result;
+}
+#else
+counters::counters() noexcept {}
+counters::~counters() {}
+values counters::read() const noexcept { return {}; }
+#endif
+} // namespace perf
@@ -0,0 +1,177 @@
+#include "serve.hpp"
+
+#include "external/scope_guard.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fmt/core.h>
+#include <memory>
+#include <semaphore>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+namespace {
+
+[[noreturn]] void fail(std::string_view what) {
+  throw std::runtime_error(fmt::format("{}: {}", what, std::strerror(errno)));
+}
+
+sockaddr_un address(std::string_view path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    throw std::runtime_error(fmt::format("socket path {} is too long", path));
+  path.copy(addr.sun_path, path.size());
+  return addr;
+}
+
+// A client that connects and then says nothing, or stops reading its reply,
+// gives up its thread after this long
+constexpr int timeout_seconds = 30;
+
+// jobs that run at once, further connections wait in the backlog
+unsigned max_jobs() { return std::max(2u, std::thread::hardware_concurrency()); }
+
+void set_timeouts(int fd) {
+  timeval timeout{.tv_sec = timeout_seconds, .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// -1 if nothing is listening
+int connect_to(std::string_view path) {
+  auto addr = address(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    fail("socket");
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads up to and excluding the first newline, nullopt if the peer hung up or
+// timed out before sending one
+std::optional<std::string> read_line(int fd) {
+  std::string line;
+  char buffer[512];
+  while (true) {
+    auto n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return std::nullopt;
+    line.append(buffer, n);
+    if (auto end = line.find('\n'); end != std::string::npos) {
+      line.resize(end);
+      return line;
+    }
+  }
+}
+
+bool write_line(int fd, std::string_view line) {
+  auto data = fmt::format("{}\n", line);
+  std::string_view rest = data;
+  while (!rest.empty()) {
+    auto n = send(fd, rest.data(), rest.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    rest.remove_prefix(n);
+  }
+  return true;
+}
+
+} // namespace
+
+void serve::listen(std::string_view path, handler const &handle) {
+  if (int fd = connect_to(path); fd >= 0) {
+    close(fd);
+    throw std::runtime_error(
+        fmt::format("a daemon is already listening on {}", path));
+  }
+  auto addr = address(path);
+  unlink(addr.sun_path);
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0)
+    fail("socket");
+  if (bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    fail(fmt::format("bind {}", path));
+  if (::listen(server, 16) != 0)
+    fail("listen");
+
+  // shared with the client threads, which can outlive a listen that failed
+  auto shared_handle = std::make_shared<handler const>(handle);
+  auto free_slots = std::make_shared<std::counting_semaphore<>>(max_jobs());
+  while (true) {
+    free_slots->acquire();
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0) {
+      free_slots->release();
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fail("accept");
+    }
+    set_timeouts(client);
+    auto serve_client = [shared_handle, free_slots, client]() {
+      auto guard = sg::make_scope_guard([&]() {
+        close(client);
+        free_slots->release();
+      });
+      // a client that timed out or hung up before a whole line runs no job
+      auto line = read_line(client);
+      if (!line)
+        return;
+      std::string reply;
+      try {
+        reply = (*shared_handle)(*line);
+      } catch (std::exception const &e) {
+        reply = fmt::format("error: {}", e.what());
+      }
+      // a client that hung up gets no reply, but the job still ran
+      write_line(client, reply);
+    };
+    try {
+      std::thread(serve_client).detach();
+    } catch (std::system_error const &) {
+      // out of threads, this one client goes without
+      close(client);
+      free_slots->release();
+    }
+  }
+}
+
+std::optional<std::string> serve::request(std::string_view path,
+                                          std::string_view request) {
+  int fd = connect_to(path);
+  if (fd < 0)
+    return std::nullopt;
+  auto guard = sg::make_scope_guard([&]() { close(fd); });
+  if (!write_line(fd, request))
+    fail("send");
+  return read_line(fd).value_or("");
+}
+
+#else
+
+void serve::listen(std::string_view, handler const &) {
+  throw std::runtime_error("faegen --serve needs Unix domain sockets");
+}
+
+std::optional<std::string> serve::request(std::string_view,
+                                          std::string_view) {
+  return std::nullopt;
+}
+
+#endif
@@ -0,0 +1,171 @@
+#include "throw_paths.hpp"
+
+#include "instrument.hpp"
+#include <algorithm>
+#include <array>
+#include <span>
+#include <string_view>
+
+namespace {
+using namespace std::string_view_literals;
+
+// What starts a throw, or continues one after a cleanup. Everything that
+// throws ends up in one of these.
+constexpr std::array throw_functions = {
+    "__cxa_throw"sv,
+    "__cxa_rethrow"sv,
+    "_Unwind_RaiseException"sv,
+    "_Unwind_Resume"sv,
+    "_Unwind_Resume_or_Rethrow"sv,
+    "_Unwind_ForcedUnwind"sv,
+};
+
+struct function {
+  code_range code;
+  elf::section const *section;
+  bool throws = false;
+};
+
+// Calls f with the target of each call or jump out of code, which starts at
+// address pc, and with nullopt for each indirect one. Branches that can't
+// leave a function (brxx, the skips) are not reported.
+template <typename F> void each_call(std::span<const uint8_t> code,
+                                     uint64_t pc, F &&f) {
+  auto word = [&](size_t i) {
+    return uint16_t(code[i] | code[i + 1] << 8);
+  };
+  for (size_t i = 0; i + 1 < code.size();) {
+    auto w = word(i);
+    auto at = pc + i;
+    // call and jmp, 22 bit word address split over both words
+    if ((w & 0xfe0c) == 0x940c) {
+      if (i + 3 >= code.size())
+        break;
+      uint64_t k = uint64_t((w & 0x01f0) >> 3 | (w & 1)) << 16 | word(i + 2);
+      f(std::optional<uint64_t>(k * 2));
+      i += 4;
+      continue;
+    }
+    // rcall and rjmp, 12 bit signed word offset
+    if ((w & 0xe000) == 0xc000) {
+      auto k = int64_t(w & 0x0fff);
+      if (k & 0x800)
+        k -= 0x1000;
+      f(std::optional<uint64_t>(at + 2 + k * 2));
+    } else if (w == 0x9509 || w == 0x9519 || w == 0x9409 || w == 0x9419) {
+      // icall, eicall, ijmp, eijmp
+      f(std::optional<uint64_t>());
+    } else if ((w & 0xfc0f) == 0x9000) {
+      // lds and sts take a second word
+      i += 2;
+    }
+    i += 2;
+  }
+}
+} // namespace
+
+std::optional<std::pmr::vector<code_range>>
+unthrown_functions(elf::file const &e, std::pmr::memory_resource *mr,
+                   diagnostics const &warn) {
+  auto timer = instrument::scope(instrument::phase::throw_paths);
+  auto executable = [&](elf::section const &sh) {
+    return (sh.flags & elf::sh::alloc) && (sh.flags & elf::sh::execinstr);
+  };
+  std::pmr::vector<function> functions(mr);
+  std::pmr::vector<uint64_t> roots(mr);
+  bool have_symbols = false;
+  for (auto &sh : e.sections) {
+    if (sh.type != elf::sh::sym_tab)
+      continue;
+    have_symbols = true;
+    for (auto &s : elf::read_symbols(e, sh, mr)) {
+      if (s.section == 0 || s.section >= e.sections.size() ||
+          !executable(e.get_section(s.section)))
+        continue;
+      if (std::ranges::find(throw_functions, s.name) != throw_functions.end())
+        roots.push_back(s.value);
+      if (s.type() == elf::func && s.size != 0)
+        functions.push_back({.code = {s.value, s.value + s.size},
+                             .section = &e.get_section(s.section)});
+    }
+  }
+  if (!have_symbols) {
+    warn("No symbol table to find throw paths in, keeping every entry");
+    return std::nullopt;
+  }
+  if (roots.empty()) {
+    warn("No throw function in the symbol table, keeping every entry");
+    return std::nullopt;
+  }
+  // aliases share one function, the largest
+  std::ranges::sort(functions, [](function const &a, function const &b) {
+    if (a.code.begin != b.code.begin)
+      return a.code.begin < b.code.begin;
+    return a.code.end > b.code.end;
+  });
+  auto [dupes, _] = std::ranges::unique(
+      functions, {}, [](function const &f) { return f.code.begin; });
+  functions.erase(dupes, functions.end());
+
+  // the function containing address
+  auto find = [&](uint64_t address) -> function * {
+    auto it = std::ranges::upper_bound(
+        functions, address, {}, [](function const &f) { return f.code.begin; });
+    if (it == functions.begin() || address >= std::prev(it)->code.end)
+      return nullptr;
+    return &*std::prev(it);
+  };
+  for (auto root : roots) {
+    if (auto f = find(root))
+      f->throws = true;
+  }
+
+  // callee -> caller, by index into functions
+  std::pmr::vector<std::pair<uint32_t, uint32_t>> calls(mr);
+  for (uint32_t i = 0; i < functions.size(); i++) {
+    auto &f = functions[i];
+    auto &sh = *f.section;
+    if (f.code.begin < sh.address ||
+        f.code.end > sh.address + sh.data.size()) {
+      f.throws = true;
+      continue;
+    }
+    auto code = std::span(sh.data).subspan(f.code.begin - sh.address,
+                                           f.code.end - f.code.begin);
+    each_call(code, f.code.begin, [&](std::optional<uint64_t> target) {
+      auto callee = target ? find(*target) : nullptr;
+      if (!callee)
+        f.throws = true;
+      else if (callee != &f)
+        calls.push_back({uint32_t(callee - functions.data()), i});
+    });
+  }
+  std::ranges::sort(calls);
+
+  // everything that reaches a throwing function throws as well
+  std::pmr::vector<uint32_t> work(mr);
+  for (uint32_t i = 0; i < functions.size(); i++) {
+    if (functions[i].throws)
+      work.push_back(i);
+  }
+  while (!work.empty()) {
+    auto callee = work.back();
+    work.pop_back();
+    auto [first, last] = std::ranges::equal_range(
+        calls, callee, {}, &std::pair<uint32_t, uint32_t>::first);
+    for (auto [_, caller] : std::ranges::subrange(first, last)) {
+      if (!functions[caller].throws) {
+        functions[caller].throws = true;
+        work.push_back(caller);
+      }
+    }
+  }
+
+  std::pmr::vector<code_range> result(mr);
+  for (auto &f : functions) {
+    if (!f.throws)
+      result.push_back(f.code);
+  }
+  timer.items(functions.size());
+  return result;
+}
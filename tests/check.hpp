@@ -0,0 +1,73 @@
+#pragma once
+
+#include "elf/elf.hpp"
+#include "fae_table.hpp"
+#include "generate.hpp"
+#include "io.hpp"
+#include "target.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fmt/core.h>
+#include <source_location>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// What the tests next to this share. Each test is an executable that gets the
+// directory of the fixtures in tests/fae, runs all of its checks and exits
+// with 1 if any failed, after printing where.
+namespace test {
+inline int failed = 0;
+
+inline void check(bool ok, std::string_view what,
+                  std::source_location where = std::source_location::current()) {
+  if (ok)
+    return;
+  fmt::println(stderr, "{}:{}: {}", where.file_name(), where.line(), what);
+  failed++;
+}
+
+inline int result() {
+  if (failed != 0)
+    fmt::println(stderr, "{} checks failed", failed);
+  return failed != 0;
+}
+
+inline std::filesystem::path fixtures(int argc, char **argv) {
+  if (argc != 2) {
+    fmt::println(stderr, "usage: {} <tests/fae>", argc ? argv[0] : "test");
+    std::exit(2);
+  }
+  return argv[1];
+}
+
+// The table faegen links into the fixture, read back like readfae does
+template <typename Target = fae::target::avr>
+auto generate(std::filesystem::path const &fixture,
+              generate_options options = {}) {
+  auto input = read_file(fixture.string());
+  auto out = generate_fae(input, options);
+  if (!out)
+    throw std::runtime_error(
+        fmt::format("nothing generated for {}", fixture.string()));
+  auto elf = elf::parse_buffer(*out);
+  return fae::read_fae<Target>(elf);
+}
+
+// The instructions of an entry, as readfae prints them
+template <typename Target = fae::target::avr, typename Entry>
+std::vector<std::string> describe(Entry const &e,
+                                  std::span<const fae::frame_inst> data,
+                                  uint32_t offset) {
+  std::vector<std::string> result;
+  if (e.length == 0)
+    return result;
+  fae::for_each_inst(data.subspan(e.data - offset, e.length), [&](auto inst) {
+    result.push_back(fae::describe<Target>(inst));
+  });
+  return result;
+}
+} // namespace test
@@ -0,0 +1,11 @@
+# A .bss much larger than what follows it in the file, so that its
+# offset + size lies past the end. Assembled with
+#   as --32 bss_past_eof.s -o bss_past_eof32.o
+#   as --64 bss_past_eof.s -o bss_past_eof64.o
+	.text
+	.globl f
+f:	ret
+
+	.bss
+	.globl buffer
+buffer:	.skip 1048576
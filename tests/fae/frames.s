@@ -0,0 +1,73 @@
+# Frames that need more or less than one skip to get from SP to the saved
+# registers. The code is filler, only the CFI matters. Assembled and linked
+# as an AVR image with
+#   as --32 frames.s -o frames.o
+#   ld -m elf_i386 -Ttext=0 --section-start=.eh_frame=0x1000 -e 0 \
+#     frames.o -o frames.elf
+#   printf '\123' | dd of=frames.elf bs=1 seek=18 conv=notrunc
+	.text
+	.globl small
+	.type small,@function
+small:	.fill 6,1,0
+	.size small,.-small
+	.globl edge
+	.type edge,@function
+edge:	.fill 4,1,0
+	.size edge,.-edge
+	.globl big
+	.type big,@function
+big:	.fill 4,1,0
+	.size big,.-big
+
+	.section .eh_frame,"a"
+cie:	.long cie_end - cie_start
+cie_start:
+	.long 0
+	.byte 1
+	.asciz "zR"
+	.uleb128 2
+	.sleb128 -1
+	.byte 36
+	.uleb128 1
+	.byte 0x1b
+	.byte 0x0c; .uleb128 32; .uleb128 2
+	.byte 0x80+36; .uleb128 1
+	.balign 4,0
+cie_end:
+# push r28, then 10 bytes of locals
+small_f: .long small_e - small_s
+small_s:
+	.long small_s - cie
+	.long small - .
+	.long 6
+	.uleb128 0
+	.byte 0x42
+	.byte 0x0e; .uleb128 3
+	.byte 0x80+28; .uleb128 2
+	.byte 0x44
+	.byte 0x0e; .uleb128 13
+	.balign 4,0
+small_e:
+# as many bytes of locals as a single skip moves
+edge_f:	.long edge_e - edge_s
+edge_s:
+	.long edge_s - cie
+	.long edge - .
+	.long 4
+	.uleb128 0
+	.byte 0x42
+	.byte 0x0e; .uleb128 129
+	.balign 4,0
+edge_e:
+# 300 bytes of locals, three skips or one adjust_sp
+big_f:	.long big_e - big_s
+big_s:
+	.long big_s - cie
+	.long big - .
+	.long 4
+	.uleb128 0
+	.byte 0x42
+	.byte 0x0e; .uleb128 302
+	.balign 4,0
+big_e:
+	.long 0
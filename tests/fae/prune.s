@@ -0,0 +1,67 @@
+# FDEs that --gc-sections and duplicate definitions leave behind: ones
+# resolved to 0 or outside of .text, one not starting at a symbol, an empty
+# one and two for the same function. c and d have the same program. The code
+# is filler. Assembled and linked as an AVR image with
+#   as --32 prune.s -o prune.o
+#   ld -m elf_i386 -Ttext=0x100 --section-start=.eh_frame=0x1000 -e 0x100 \
+#     prune.o -o prune.elf
+#   printf '\123' | dd of=prune.elf bs=1 seek=18 conv=notrunc
+	.text
+	.globl a
+	.type a,@function
+a:	.fill 4,1,0
+	.size a,.-a
+	.globl b
+	.type b,@function
+b:	.fill 4,1,0
+	.size b,.-b
+	.globl c
+	.type c,@function
+c:	.fill 4,1,0
+	.size c,.-c
+	.globl d
+	.type d,@function
+d:	.fill 4,1,0
+	.size d,.-d
+
+	.section .eh_frame,"a"
+cie:	.long cie_end - cie_start
+cie_start:
+	.long 0
+	.byte 1
+	.asciz "zR"
+	.uleb128 2
+	.sleb128 -1
+	.byte 36
+	.uleb128 1
+	.byte 0x1b
+	.byte 0x0c; .uleb128 32; .uleb128 2
+	.byte 0x80+36; .uleb128 1
+	.balign 4,0
+cie_end:
+
+	.macro fde name, begin, length, reg
+\name\()_f: .long \name\()_e - \name\()_s
+\name\()_s:
+	.long \name\()_s - cie
+	.long \begin - .
+	.long \length
+	.uleb128 0
+	.byte 0x41
+	.byte 0x0e; .uleb128 3
+	.byte 0x80+\reg; .uleb128 2
+	.balign 4,0
+\name\()_e:
+	.endm
+
+	fde a, a, 4, 17
+	fde tombstone, 0, 4, 17
+	fde outside, 0x5000, 4, 17
+# the first covers only part of b, the second matches its symbol
+	fde b_part, b, 2, 17
+	fde b, b, 4, 16
+	fde inside, b+2, 2, 17
+	fde empty, c, 0, 17
+	fde c, c, 4, 2
+	fde d, d, 4, 2
+	.long 0
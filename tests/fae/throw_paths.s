@@ -0,0 +1,64 @@
+# A call graph around __cxa_throw in AVR machine code, one word per .short:
+# call/jmp are 0x940e/0x940c and a word address, rcall/rjmp 0xdxxx/0xcxxx,
+# icall 0x9509, lds 0x9180 and its address, ret 0x9508, nop 0. Each function
+# pushes r17. Assembled and linked as an AVR image with
+#   as --32 throw_paths.s -o throw_paths.o
+#   ld -m elf_i386 -Ttext=0 --section-start=.eh_frame=0x1000 -e 0 \
+#     throw_paths.o -o throw_paths.elf
+#   printf '\123' | dd of=throw_paths.elf bs=1 seek=18 conv=notrunc
+	.macro function name, words:vararg
+	.globl \name
+	.type \name,@function
+\name:	.short \words
+.L\name\()_end:
+	.size \name,.-\name
+	.endm
+
+	.text
+	function __cxa_throw, 0, 0x9508		# 0x00
+	function thrower, 0, 0x940e, 0, 0x9508	# 0x04, calls __cxa_throw
+	function mid, 0xdffb, 0x9508		# 0x0c, rcalls thrower
+	function top, 0x940e, 6, 0x9508		# 0x10, calls mid
+	function isr, 0xd002, 0, 0x9508		# 0x16, rcalls leaf
+	function leaf, 0, 0x9508		# 0x1c
+	function indirect, 0x9509, 0x9508	# 0x20, icall
+	function tailer, 0, 0xcfee		# 0x24, rjmps to thrower
+	function driver, 0x940e, 11, 0, 0x9508	# 0x28, calls isr
+	function far, 0x940c, 2			# 0x30, jmps to thrower
+	function stray, 0x940e, 0x80, 0x9508	# 0x34, calls past the code
+	function loader, 0x9180, 0x940e, 2, 0x9508 # 0x3a, lds r24 from 0x940e
+
+	.section .eh_frame,"a"
+cie:	.long cie_end - cie_start
+cie_start:
+	.long 0
+	.byte 1
+	.asciz "zR"
+	.uleb128 2
+	.sleb128 -1
+	.byte 36
+	.uleb128 1
+	.byte 0x1b
+	.byte 0x0c; .uleb128 32; .uleb128 2
+	.byte 0x80+36; .uleb128 1
+	.balign 4,0
+cie_end:
+
+	.macro fde name
+\name\()_f: .long \name\()_e - \name\()_s
+\name\()_s:
+	.long \name\()_s - cie
+	.long \name - .
+	.long .L\name\()_end - \name
+	.uleb128 0
+	.byte 0x41
+	.byte 0x0e; .uleb128 3
+	.byte 0x80+17; .uleb128 2
+	.balign 4,0
+\name\()_e:
+	.endm
+
+	.irp name, __cxa_throw, thrower, mid, top, isr, leaf, indirect, tailer, driver, far, stray, loader
+	fde \name
+	.endr
+	.long 0
@@ -0,0 +1,67 @@
+# Functions that only need their return address popped, next to ones that
+# need more: n1 pushes r17, y1 keeps its frame in Y. The code is filler.
+# Assembled and linked as an AVR image with
+#   as --32 trivial.s -o trivial.o
+#   ld -m elf_i386 -Ttext=0 --section-start=.eh_frame=0x1000 -e 0 \
+#     trivial.o -o trivial.elf
+#   printf '\123' | dd of=trivial.elf bs=1 seek=18 conv=notrunc
+	.text
+	.irp name, t1, t2, n1, t3, y1, t4, t5
+	.globl \name
+	.type \name,@function
+	.endr
+t1:	.fill 4,1,0
+	.size t1,.-t1
+t2:	.fill 2,1,0
+	.size t2,.-t2
+n1:	.fill 4,1,0
+	.size n1,.-n1
+t3:	.fill 2,1,0
+	.size t3,.-t3
+y1:	.fill 2,1,0
+	.size y1,.-y1
+t4:	.fill 6,1,0
+	.size t4,.-t4
+t5:	.fill 2,1,0
+	.size t5,.-t5
+
+	.section .eh_frame,"a"
+cie:	.long cie_end - cie_start
+cie_start:
+	.long 0
+	.byte 1
+	.asciz "zR"
+	.uleb128 2
+	.sleb128 -1
+	.byte 36
+	.uleb128 1
+	.byte 0x1b
+	.byte 0x0c; .uleb128 32; .uleb128 2
+	.byte 0x80+36; .uleb128 1
+	.balign 4,0
+cie_end:
+
+	.macro fde name, length, cfa:vararg
+\name\()_f: .long \name\()_e - \name\()_s
+\name\()_s:
+	.long \name\()_s - cie
+	.long \name - .
+	.long \length
+	.uleb128 0
+	.ifnb \cfa
+	.byte \cfa
+	.endif
+	.balign 4,0
+\name\()_e:
+	.endm
+
+	fde t1, 4
+	fde t2, 2
+# push r17
+	fde n1, 4, 0x41, 0x0e, 3, 0x80+17, 2
+	fde t3, 2
+# def_cfa_register r28
+	fde y1, 2, 0x0d, 28
+	fde t4, 6
+	fde t5, 2
+	.long 0
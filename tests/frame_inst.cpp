@@ -0,0 +1,73 @@
+#include "check.hpp"
+#include "fae.hpp"
+#include <algorithm>
+#include <array>
+
+// adjust_sp: its encoding, and faegen using it only where the cost model says
+// it is faster than a run of skips
+namespace {
+using test::check;
+
+void encoding() {
+  auto inst = fae::encode(fae::adjust_sp{0x1234});
+  check(inst[0].is_adjust_sp() && !inst[0].is_pop() && !inst[0].is_skip(),
+        "adjust_sp opcode is neither pop nor skip");
+  check(inst[0].size() == fae::adjust_sp::size, "adjust_sp size");
+  check(inst[1].byte == 0x34 && inst[2].byte == 0x12,
+        "adjust_sp operand is little endian");
+  check(fae::describe(inst) == "adjust sp by 4660 bytes", "describe adjust_sp");
+  check(fae::features_of(inst) == fae::extended_inst,
+        "adjust_sp needs extended_inst");
+
+  std::array<fae::frame_inst, 2> plain = {fae::skip(3),
+                                          fae::pop(fae::reg::r28)};
+  check(fae::features_of(plain) == 0, "skip and pop need no feature");
+
+  auto truncated = std::span(inst).first(2);
+  bool threw = false;
+  try {
+    fae::for_each_inst(truncated, [](auto) {});
+  } catch (std::out_of_range const &) {
+    threw = true;
+  }
+  check(threw, "adjust_sp without its operand is rejected");
+}
+
+void cost_model() {
+  check(fae::cost::skips(fae::skip::max_skip_bytes) <
+            fae::cost::adjust(fae::skip::max_skip_bytes),
+        "one skip beats adjust_sp");
+  check(fae::cost::adjust(fae::skip::max_skip_bytes + 1) <
+            fae::cost::skips(fae::skip::max_skip_bytes + 1),
+        "adjust_sp beats two skips");
+}
+
+void generated(std::filesystem::path const &dir) {
+  auto [table, data, offset, hot, trivial] =
+      test::generate(dir / "frames.elf");
+  check(table.size() == 3, "an entry per function");
+  auto program = [&](uint64_t pc) {
+    auto it = std::ranges::find(table, pc, [](auto &e) {
+      return uint64_t(e.pc_begin);
+    });
+    return it == table.end() ? std::vector<std::string>{"missing"}
+                             : test::describe(*it, data, offset);
+  };
+  check(program(0x0) == std::vector<std::string>{"skip 10 bytes", "pop r28"},
+        "small: skips the locals, pops the saved register");
+  check(program(0x6) == std::vector<std::string>{"skip 127 bytes"},
+        "edge: a single skip");
+  check(program(0xa) == std::vector<std::string>{"adjust sp by 300 bytes"},
+        "big: adjust_sp instead of three skips");
+  check(fae::features_of(data) == fae::extended_inst,
+        "the table is marked as using adjust_sp");
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  auto dir = test::fixtures(argc, argv);
+  encoding();
+  cost_model();
+  generated(dir);
+  return test::result();
+}
@@ -0,0 +1,164 @@
+/* The status every libfae call returns on the way a C host uses it: asking
+ * for sizes first, then filling its own buffers. Gets the directory of the
+ * fixtures in tests/fae and exits with 1 if any check failed. */
+#include "libfae.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failed = 0;
+
+#define CHECK(cond, what)                                                      \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, what);                \
+      failed++;                                                                \
+    }                                                                          \
+  } while (0)
+
+static uint8_t *read_fixture(const char *dir, const char *name, size_t *size) {
+  char path[4096];
+  snprintf(path, sizeof path, "%s/%s", dir, name);
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "could not open %s\n", path);
+    exit(2);
+  }
+  fseek(f, 0, SEEK_END);
+  *size = (size_t)ftell(f);
+  rewind(f);
+  uint8_t *data = malloc(*size);
+  if (!data || fread(data, 1, *size, f) != *size) {
+    fprintf(stderr, "could not read %s\n", path);
+    exit(2);
+  }
+  fclose(f);
+  return data;
+}
+
+/* the object fae_generate links for input, sized by a first call */
+static uint8_t *generate(const uint8_t *input, size_t input_size,
+                         const fae_options *options, size_t *size) {
+  fae_status s = fae_generate(input, input_size, options, NULL, 0, size);
+  CHECK(s == FAE_BUFFER_TOO_SMALL, "a call without a buffer asks for the size");
+  CHECK(*size != 0, "the size is set");
+  CHECK(strstr(fae_last_error(), "bytes") != NULL,
+        "the error says how many bytes are needed");
+  uint8_t *out = malloc(*size);
+  size_t written = 0;
+  s = fae_generate(input, input_size, options, out, *size, &written);
+  CHECK(s == FAE_OK, "the result fits the buffer it asked for");
+  CHECK(written == *size, "the size doesn't change");
+  CHECK(fae_last_error()[0] == '\0', "success clears the error");
+  return out;
+}
+
+static void arguments(const uint8_t *input, size_t input_size) {
+  size_t size = 0;
+  CHECK(fae_generate(NULL, 0, NULL, NULL, 0, &size) == FAE_INVALID_ARGUMENT,
+        "fae_generate without input");
+  CHECK(fae_generate(input, input_size, NULL, NULL, 0, NULL) ==
+            FAE_INVALID_ARGUMENT,
+        "fae_generate without out_size");
+  CHECK(fae_generate(input, input_size, NULL, NULL, 16, &size) ==
+            FAE_INVALID_ARGUMENT,
+        "fae_generate with a capacity but no buffer");
+  CHECK(fae_last_error()[0] != '\0', "invalid arguments set the error");
+
+  fae_table table = {0};
+  table.entries_capacity = 4;
+  CHECK(fae_decode_table(input, input_size, &table) == FAE_INVALID_ARGUMENT,
+        "fae_decode_table with a capacity but no entries");
+  CHECK(fae_decode_table(input, input_size, NULL) == FAE_INVALID_ARGUMENT,
+        "fae_decode_table without a table");
+
+  const fae_entry *entry = NULL;
+  table.entries_capacity = 0;
+  table.hot_count = 1;
+  CHECK(fae_lookup_pc(&table, 0, &entry) == FAE_INVALID_ARGUMENT,
+        "fae_lookup_pc with more hot entries than entries");
+  CHECK(fae_lookup_pc(NULL, 0, &entry) == FAE_INVALID_ARGUMENT,
+        "fae_lookup_pc without a table");
+}
+
+static void bad_input(void) {
+  static const uint8_t garbage[64] = {0x7f, 'E', 'L', 'F', 9, 9, 9};
+  size_t size = 0;
+  CHECK(fae_generate(garbage, sizeof garbage, NULL, NULL, 0, &size) ==
+            FAE_BAD_INPUT,
+        "fae_generate of something that isn't ELF");
+  CHECK(fae_last_error()[0] != '\0', "bad input sets the error");
+
+  fae_table table = {0};
+  CHECK(fae_decode_table(garbage, sizeof garbage, &table) == FAE_BAD_INPUT,
+        "fae_decode_table of something that isn't ELF");
+}
+
+static void link_and_decode(const uint8_t *input, size_t input_size) {
+  size_t size = 0;
+  uint8_t *out = generate(input, input_size, NULL, &size);
+
+  /* the result is an object without unwind info to encode */
+  fae_options object = {.flags = FAE_OBJECT};
+  size_t again = 1;
+  CHECK(fae_generate(out, size, &object, NULL, 0, &again) ==
+            FAE_NOTHING_TO_DO,
+        "an object without .eh_frame has nothing to do");
+  CHECK(again == 0, "nothing to do sets the size to 0");
+
+  fae_table table = {0};
+  CHECK(fae_decode_table(out, size, &table) == FAE_BUFFER_TOO_SMALL,
+        "decoding without buffers");
+  CHECK(table.entry_count == 3 && table.inst_count != 0,
+        "the counts are set without buffers");
+  CHECK(table.machine == 83, "the table is for AVR");
+
+  table.entries = malloc(table.entry_count * sizeof *table.entries);
+  table.entries_capacity = table.entry_count;
+  table.insts = malloc(table.inst_count);
+  table.insts_capacity = table.inst_count;
+  CHECK(fae_decode_table(out, size, &table) == FAE_OK,
+        "decoding into buffers of the counted size");
+
+  const fae_entry *entry = NULL;
+  CHECK(fae_lookup_pc(&table, 0x7, &entry) == FAE_OK && entry &&
+            entry->pc_begin == 0x6 && entry->pc_end == 0xa,
+        "0x7 is in edge");
+  CHECK(fae_lookup_pc(&table, 0x100, &entry) == FAE_NOT_FOUND,
+        "0x100 is past the code");
+
+  free(table.entries);
+  free(table.insts);
+  free(out);
+}
+
+static void warnings(const uint8_t *input, size_t input_size) {
+  /* there is no throw to search from in the fixture */
+  fae_options options = {.flags = FAE_THROW_PATHS_ONLY};
+  size_t size = 0;
+  uint8_t *out = generate(input, input_size, &options, &size);
+  CHECK(fae_last_warnings()[0] != '\0', "keeping every entry is a warning");
+  free(out);
+
+  fae_table table = {0};
+  fae_decode_table(input, input_size, &table);
+  CHECK(fae_last_warnings()[0] == '\0', "the next call clears the warnings");
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <tests/fae>\n", argc ? argv[0] : "test");
+    return 2;
+  }
+  size_t size = 0;
+  uint8_t *input = read_fixture(argv[1], "frames.elf", &size);
+  arguments(input, size);
+  bad_input();
+  link_and_decode(input, size);
+  warnings(input, size);
+  free(input);
+  if (failed != 0)
+    fprintf(stderr, "%d checks failed\n", failed);
+  return failed != 0;
+}
@@ -0,0 +1,71 @@
+#include "check.hpp"
+#include <stdexcept>
+
+// faegen --profile: the hottest entries first and counted in the header, the
+// rest sorted by pc_begin, and the programs in the order entries use them
+namespace {
+using test::check;
+
+auto begins(auto const &table) {
+  std::vector<uint64_t> result;
+  for (auto &e : table)
+    result.push_back(e.pc_begin);
+  return result;
+}
+
+void ordered(std::filesystem::path const &fixture) {
+  // edge (0x6) is unwound through 10 times, big (0xa) 5, small (0x0) never
+  auto [table, data, offset, hot, trivial] =
+      test::generate(fixture, {.profile = "0xa 5\n0x6 9 # two PCs\n0x7\n"});
+  check(hot == 2, "two entries are hot");
+  check(begins(table) == std::vector<uint64_t>{0x6, 0xa, 0x0},
+        "hottest first, then the rest by pc_begin");
+  check(table[0].data == offset, "the hottest entry's program comes first");
+  check(table[1].data == offset + table[0].length,
+        "the next hot entry's program follows it");
+}
+
+void ties(std::filesystem::path const &fixture) {
+  auto [table, data, offset, hot, trivial] =
+      test::generate(fixture, {.profile = "0xa 3\n0x0 3\n"});
+  check(hot == 2, "two entries are hot");
+  check(begins(table) == std::vector<uint64_t>{0x0, 0xa, 0x6},
+        "equally hot entries by pc_begin");
+}
+
+void cold(std::filesystem::path const &fixture) {
+  auto [table, data, offset, hot, trivial] =
+      test::generate(fixture, {.profile = "0x1000 7\n"});
+  check(hot == 0, "no entry covers the profile");
+  check(begins(table) == std::vector<uint64_t>{0x0, 0x6, 0xa},
+        "without hot entries the table is sorted");
+
+  auto unprofiled = test::generate(fixture);
+  check(std::get<3>(unprofiled) == 0, "no profile, no hot entries");
+  check(begins(std::get<0>(unprofiled)) ==
+            std::vector<uint64_t>{0x0, 0x6, 0xa},
+        "no profile, sorted by pc_begin");
+}
+
+void malformed(std::filesystem::path const &fixture) {
+  auto rejected = [&](std::string_view profile) {
+    try {
+      test::generate(fixture, {.profile = profile});
+    } catch (std::runtime_error const &) {
+      return true;
+    }
+    return false;
+  };
+  check(rejected("0x6 1 2\n"), "a line with two counts is rejected");
+  check(rejected("0x6\nsix\n"), "a line that isn't a number is rejected");
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  auto fixture = test::fixtures(argc, argv) / "frames.elf";
+  ordered(fixture);
+  ties(fixture);
+  cold(fixture);
+  malformed(fixture);
+  return test::result();
+}
@@ -0,0 +1,41 @@
+#include "check.hpp"
+
+// The FDEs faegen leaves out of a linked image: discarded, outside of code,
+// not at a symbol or empty, the loser of two for the same function, and
+// neighbours merged into one entry
+namespace {
+using test::check;
+
+struct row {
+  uint64_t begin, end;
+  std::vector<std::string> program;
+  bool operator==(row const &) const = default;
+};
+
+void pruned(std::filesystem::path const &dir) {
+  auto [table, data, offset, hot, trivial] =
+      test::generate(dir / "prune.elf");
+  std::vector<row> rows;
+  for (auto &e : table)
+    rows.push_back({e.pc_begin, e.pc_end, test::describe(e, data, offset)});
+  check(rows.size() == 3, "one entry for a, b and the merged c and d");
+  check(rows.size() > 0 && rows[0] == row{0x100, 0x104, {"pop r17"}},
+        "a keeps its entry next to a partial FDE for b");
+  check(rows.size() > 1 && rows[1] == row{0x104, 0x108, {"pop r16"}},
+        "b's FDE matching its symbol wins over the partial one");
+  check(rows.size() > 2 && rows[2] == row{0x108, 0x110, {"pop r2"}},
+        "c and d share a program and are merged");
+  check(trivial.empty(), "no trivial ranges");
+  for (auto &r : rows) {
+    check(r.begin != 0 && r.begin != 0x5000,
+          "FDEs outside of .text are dropped");
+    check(r.begin != 0x106, "an FDE not starting at a symbol is dropped");
+  }
+  check(data.size() == 3, "programs only dropped FDEs used are left out");
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  pruned(test::fixtures(argc, argv));
+  return test::result();
+}
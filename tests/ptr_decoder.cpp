@@ -0,0 +1,86 @@
+#include "check.hpp"
+#include "consume.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+// The decoder select_ptr_decoder picks for a CIE's encoding reads a pointer
+// the same way consume_ptr does, and encodings without a base known while
+// parsing .eh_frame are refused
+namespace {
+using test::check;
+
+constexpr uint64_t pc = 0x1000;
+
+struct sample {
+  uint8_t format;
+  std::array<uint8_t, 8> bytes;
+  int64_t value;
+  size_t size;
+};
+
+constexpr sample samples[] = {
+    {DW_EH_PE_absptr, {0x78, 0x56, 0x34, 0x12}, 0x12345678, 4},
+    {DW_EH_PE_udata2, {0xfe, 0xff}, 0xfffe, 2},
+    {DW_EH_PE_udata4, {0xfe, 0xff, 0xff, 0xff}, 0xfffffffe, 4},
+    {DW_EH_PE_udata8, {1, 0, 0, 0, 0, 0, 0, 1}, 0x0100000000000001, 8},
+    {DW_EH_PE_uleb128, {0xe5, 0x8e, 0x26}, 624485, 3},
+    {DW_EH_PE_sdata2, {0xfe, 0xff}, -2, 2},
+    {DW_EH_PE_sdata4, {0xfe, 0xff, 0xff, 0xff}, -2, 4},
+    {DW_EH_PE_sdata8, {0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}, -2, 8},
+    {DW_EH_PE_sleb128, {0x7e}, -2, 1},
+};
+
+void formats() {
+  for (auto &s : samples) {
+    for (uint8_t application : {DW_EH_PE_absptr, DW_EH_PE_pcrel}) {
+      uint8_t encoding = s.format | application;
+      // the cursor may read a little past the pointer, like in a region
+      std::array<uint8_t, 8 + validated_region::slack> bytes{};
+      std::ranges::copy(s.bytes, bytes.begin());
+      auto c = Cursor{bytes.data(), bytes.data() + s.size};
+      auto value = select_ptr_decoder(encoding)(c, pc);
+      auto expected = s.value + (application == DW_EH_PE_pcrel ? pc : 0);
+      check(value == int64_t(expected),
+            fmt::format("encoding {:#04x} decodes to {:#x}, not {:#x}",
+                        encoding, expected, value));
+      check(c.begin == bytes.data() + s.size,
+            fmt::format("encoding {:#04x} reads {} bytes", encoding, s.size));
+
+      auto r = Reader(std::span(bytes).first(s.size));
+      check(consume_ptr(r, encoding, {.pc = pc}) == value,
+            fmt::format("encoding {:#04x} agrees with consume_ptr", encoding));
+    }
+  }
+
+  std::array<uint8_t, 4 + validated_region::slack> bytes{4, 3, 2, 1};
+  auto c = Cursor{bytes.data(), bytes.data() + 4};
+  check(select_ptr_decoder(DW_EH_PE_indirect | DW_EH_PE_pcrel |
+                           DW_EH_PE_sdata4)(c, pc) == 0x01020304 + pc,
+        "DW_EH_PE_indirect is ignored");
+}
+
+void refused() {
+  auto refuses = [](uint8_t encoding) {
+    try {
+      select_ptr_decoder(encoding);
+    } catch (unsupported_cfi const &) {
+      return true;
+    }
+    return false;
+  };
+  for (uint8_t application : {DW_EH_PE_textrel, DW_EH_PE_datarel,
+                              DW_EH_PE_funcrel, DW_EH_PE_aligned})
+    check(refuses(application | DW_EH_PE_sdata4),
+          fmt::format("application {:#04x} has no base", application));
+  for (uint8_t format : {0x05, 0x06, 0x07, 0x0d, 0x0e, 0x0f})
+    check(refuses(DW_EH_PE_pcrel | format),
+          fmt::format("format {:#04x} is unknown", format));
+}
+} // namespace
+
+int main() {
+  formats();
+  refused();
+  return test::result();
+}
@@ -0,0 +1,76 @@
+#include "check.hpp"
+#include "throw_paths.hpp"
+#include <algorithm>
+#include <memory_resource>
+#include <string>
+#include <utility>
+
+// Which functions a throw can unwind through, found from the calls and jumps
+// between them, and --throw-paths-only leaving out the entries of the rest
+namespace {
+using test::check;
+using ranges = std::vector<std::pair<uint64_t, uint64_t>>;
+
+// [begin, end) of each function unthrown_functions finds, or nullopt and
+// its warnings
+std::pair<std::optional<ranges>, std::string>
+unthrown(std::filesystem::path const &fixture) {
+  auto input = read_file(fixture.string());
+  std::pmr::monotonic_buffer_resource arena;
+  auto e = elf::parse_buffer(input, &arena);
+  std::string warnings;
+  auto found = unthrown_functions(e, &arena, [&](std::string_view message) {
+    warnings += message;
+  });
+  if (!found)
+    return {std::nullopt, warnings};
+  ranges result;
+  for (auto &r : *found)
+    result.push_back({r.begin, r.end});
+  return {result, warnings};
+}
+
+void reachability(std::filesystem::path const &dir) {
+  auto [found, warnings] = unthrown(dir / "throw_paths.elf");
+  check(found.has_value(), "the image has a throw to search from");
+  check(warnings.empty(), "nothing to warn about");
+  // isr only rcalls leaf, driver only calls isr and loader's lds operand
+  // isn't a call
+  check(found == ranges{{0x16, 0x1c}, {0x1c, 0x20}, {0x28, 0x30},
+                        {0x3a, 0x42}},
+        "isr, leaf, driver and loader can't be on a throw's path");
+}
+
+void no_throw(std::filesystem::path const &dir) {
+  auto [found, warnings] = unthrown(dir / "frames.elf");
+  check(!found, "without a throw function nothing is searched");
+  check(!warnings.empty(), "and that is a warning");
+}
+
+void pruned(std::filesystem::path const &dir) {
+  auto covered = [](auto const &table, uint64_t pc) {
+    return std::ranges::any_of(table, [&](auto &e) {
+      return pc >= e.pc_begin && pc < e.pc_end;
+    });
+  };
+  auto all = std::get<0>(test::generate(dir / "throw_paths.elf"));
+  auto thrown = std::get<0>(
+      test::generate(dir / "throw_paths.elf", {.throw_paths_only = true}));
+  for (uint64_t pc : {0x16, 0x1c, 0x28, 0x3a}) {
+    check(covered(all, pc), fmt::format("{:#x} has an entry", pc));
+    check(!covered(thrown, pc),
+          fmt::format("{:#x} has none with throw_paths_only", pc));
+  }
+  for (uint64_t pc : {0x0, 0x4, 0xc, 0x10, 0x20, 0x24, 0x30, 0x34})
+    check(covered(thrown, pc),
+          fmt::format("{:#x} keeps its entry with throw_paths_only", pc));
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  auto dir = test::fixtures(argc, argv);
+  reachability(dir);
+  no_throw(dir);
+  pruned(dir);
+  return test::result();
+}
@@ -0,0 +1,45 @@
+#include "check.hpp"
+#include <utility>
+
+// Functions that only pop their return address get no entry. Their PCs go
+// into the trivial ranges, neighbours merged, and the entries keep the rest.
+namespace {
+using test::check;
+
+void split(std::filesystem::path const &dir) {
+  auto [table, data, offset, hot, trivial] =
+      test::generate(dir / "trivial.elf");
+  std::vector<std::pair<uint64_t, uint64_t>> entries, ranges;
+  for (auto &e : table)
+    entries.push_back({e.pc_begin, e.pc_end});
+  for (auto &r : trivial)
+    ranges.push_back({r.begin, r.end});
+
+  check(entries == decltype(entries){{0x6, 0xa}, {0xc, 0xe}},
+        "only n1 and y1 keep an entry");
+  check(ranges == decltype(ranges){{0x0, 0x6}, {0xa, 0xc}, {0xe, 0x16}},
+        "t1 and t2, t3, and t4 and t5 are covered by merged ranges");
+  check(table.size() == 2 && table[1].frame_reg == 28 && table[1].length == 0,
+        "a frame in Y isn't trivial even without instructions");
+  check(table.size() == 2 &&
+            test::describe(table[0], data, offset) ==
+                std::vector<std::string>{"pop r17"},
+        "n1 pops r17");
+}
+
+void hot_trivial(std::filesystem::path const &dir) {
+  // a hot PC in a trivial function doesn't bring its entry back
+  auto [table, data, offset, hot, trivial] =
+      test::generate(dir / "trivial.elf", {.profile = "0x10 5\n0x7 1\n"});
+  check(hot == 1, "only n1 is hot");
+  check(table.size() == 2 && table[0].pc_begin == 0x6, "n1 comes first");
+  check(trivial.size() == 3, "the ranges stay the same");
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  auto dir = test::fixtures(argc, argv);
+  split(dir);
+  hot_trivial(dir);
+  return test::result();
+}
@@ -1,7 +1,10 @@
 for ($i = 0; $i -le $Args.Count; $i ++)
 {
     If ($Args[$i] -ceq "-o" ){
-        If($Args[$i+1] -cmatch "^.+[^o]$"){
+        # only a name ending in .o is an object, a.out or foo.o.elf are links
+        If($Args[$i+1] -cmatch "^.+\.o$"){
+            $object  = $Args[$i+1]
+        }Else{
             $linking = $true
             $output  = $Args[$i+1]
         }
@@ -9,11 +12,26 @@ for ($i = 0; $i -le $Args.Count; $i ++)
 }
 
 $bin=$PSScriptRoot
+$faegen=@()
+If($env:FAEGEN_SOCKET){
+  $faegen=@("--connect", $env:FAEGEN_SOCKET)
+}
+
+$profile=@()
+If($env:FAEGEN_PROFILE){
+  $profile=@("--profile", $env:FAEGEN_PROFILE)
+}
 
 If($linking){
+  # a private name, so links running in parallel in one directory don't meet
+  $fae_data = Join-Path ([System.IO.Path]::GetTempPath()) ([System.IO.Path]::GetRandomFileName() + ".o")
+  & $bin\avr-g++.exe @Args
+  & $bin\faegen.exe @faegen @profile -o $fae_data $output
+  & $bin\avr-g++.exe @Args $fae_data
+  Remove-Item -ErrorAction SilentlyContinue $fae_data
+}ElseIf($object){
   & $bin\avr-g++.exe @Args
-  & $bin\faegen.exe $output
-  & $bin\avr-g++.exe @Args __fae_data.o
+  & $bin\faegen.exe @faegen --object $object
 }Else{
   & $bin\avr-g++.exe @Args
 }
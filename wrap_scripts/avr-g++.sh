@@ -5,21 +5,42 @@ set -e
 args=( "$@" )
 BIN=`dirname "$0"`
 
+# with a daemon started as `faegen --serve $FAEGEN_SOCKET`, jobs go to it
+FAEGEN="$BIN/faegen"
+if [[ -n "$FAEGEN_SOCKET" ]]; then
+  FAEGEN="$FAEGEN --connect $FAEGEN_SOCKET"
+fi
+
 for i in $(seq 0 ${#args[@]});
 do
     if [[ "${args[$i]}" = "-o" ]]; then
-      if ! [[ "${args[($i+1)]}" =~ .+\.o ]]; then
+      # only a name ending in .o is an object, a.out or foo.o.elf are links
+      if ! [[ "${args[($i+1)]}" =~ ^.+\.o$ ]]; then
         linking="yes"
         output="${args[($i+1)]}"
+      else
+        object="${args[($i+1)]}"
       fi
     fi
 done
 
+# FAEGEN_PROFILE names a PC count file that orders the table, see --profile
+PROFILE=""
+if [[ -n "$FAEGEN_PROFILE" ]]; then
+  PROFILE="--profile $FAEGEN_PROFILE"
+fi
+
 if [[ "$linking" = "yes" ]]; then
+  # a private name, so links running in parallel in one directory don't meet
+  fae_dir=$(mktemp -d)
+  trap 'rm -rf "$fae_dir"' EXIT
+  $BIN/avr-g++ $@
+  $FAEGEN $PROFILE -o "$fae_dir/__fae_data.o" $output
+  $BIN/avr-g++ $@ "$fae_dir/__fae_data.o"
+elif [[ -n "$object" ]]; then
+  # encode the object's FDEs now so the link only has to merge them
   $BIN/avr-g++ $@
-  $BIN/faegen $output
-  $BIN/avr-g++ $@ __fae_data.o
-  rm __fae_data.o
+  $FAEGEN --object $object
 else
   $BIN/avr-g++ $@
 fi